@@ -1,3 +1,25 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#ifdef IOURING
+#include <cerrno>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
 #include "bwt.h"
 
 #ifdef PRINTRSS
@@ -14,35 +36,1298 @@ void cerrMemoryUsage(const char* msg)
 #endif
 }
 
-size_t nextTempFileName = 0;
+//the run directories are removed at exit, the temp files in them have been removed by their owners
+class TempDirectories
+{
+public:
+	TempDirectories() : roots(), paths(), nextName(0), nextDirectory(0), lock() {};
+	~TempDirectories()
+	{
+		for (size_t i = 0; i < paths.size(); i++)
+		{
+			if (paths[i] != "")
+			{
+				rmdir(paths[i].c_str());
+			}
+		}
+	};
+	std::vector<std::string> roots;
+	std::vector<std::string> paths;
+	size_t nextName;
+	size_t nextDirectory;
+	std::mutex lock;
+};
+
+TempDirectories tempDirectories;
+
+void addTempDirectory(const std::string& root)
+{
+	std::lock_guard<std::mutex> guard(tempDirectories.lock);
+	assert(tempDirectories.nextName == 0);
+	tempDirectories.roots.push_back(root);
+	tempDirectories.paths.push_back("");
+}
+
+size_t numTempDirectories()
+{
+	std::lock_guard<std::mutex> guard(tempDirectories.lock);
+	return std::max(tempDirectories.roots.size(), (size_t)1);
+}
 
 std::string getTempFileName()
 {
-	std::string tryThis;
-	bool usable;
-	do
+	size_t directory;
+	{
+		std::lock_guard<std::mutex> guard(tempDirectories.lock);
+		directory = tempDirectories.nextDirectory;
+		tempDirectories.nextDirectory++;
+	}
+	return getTempFileName(directory % numTempDirectories());
+}
+
+std::string getTempFileName(size_t directory)
+{
+	std::lock_guard<std::mutex> guard(tempDirectories.lock);
+	if (tempDirectories.roots.size() == 0)
+	{
+		tempDirectories.roots.push_back(".");
+		tempDirectories.paths.push_back("");
+	}
+	assert(directory < tempDirectories.roots.size());
+	std::string& path = tempDirectories.paths[directory];
+	if (path == "")
+	{
+		std::string pattern = tempDirectories.roots[directory] + "/bwt-" + std::to_string(getpid()) + "-XXXXXX";
+		std::vector<char> name(pattern.begin(), pattern.end());
+		name.push_back('\0');
+		if (mkdtemp(name.data()) == nullptr)
+		{
+			std::cerr << "could not create a temp directory in " << tempDirectories.roots[directory] << "\n";
+			abort();
+		}
+		path = name.data();
+	}
+	std::string result = path + "/tmp" + std::to_string(tempDirectories.nextName) + ".tmp";
+	tempDirectories.nextName++;
+	return result;
+}
+
+IOBackend ioBackend = BUFFERED_IO;
+
+void setIOBackend(IOBackend backend)
+{
+	ioBackend = backend;
+}
+
+IOBackend getIOBackend()
+{
+	return ioBackend;
+}
+
+AlignedBuffer::AlignedBuffer() :
+	memory(nullptr),
+	bytes(0)
+{
+}
+
+AlignedBuffer::AlignedBuffer(size_t size) :
+	memory(nullptr),
+	bytes(0)
+{
+	resize(size);
+}
+
+AlignedBuffer::~AlignedBuffer()
+{
+	free(memory);
+}
+
+void AlignedBuffer::resize(size_t size)
+{
+	free(memory);
+	memory = nullptr;
+	bytes = size;
+	if (size == 0)
+	{
+		return;
+	}
+	void* allocated;
+	if (posix_memalign(&allocated, ioAlignment, alignUp(size)) != 0)
+	{
+		std::cerr << "could not allocate " << size << " bytes\n";
+		abort();
+	}
+	memory = (char*)allocated;
+}
+
+//loops until everything is transferred, reads stop early at the end of the file
+size_t transferAll(int fd, bool write, char* buffer, size_t bytes, size_t offset, const std::string& fileName)
+{
+	size_t done = 0;
+	while (done < bytes)
+	{
+		ssize_t got;
+		if (write)
+		{
+			got = pwrite(fd, buffer+done, bytes-done, offset+done);
+		}
+		else
+		{
+			got = pread(fd, buffer+done, bytes-done, offset+done);
+		}
+		if (got == 0 && !write)
+		{
+			break;
+		}
+		if (got <= 0)
+		{
+			std::cerr << "could not " << (write ? "write" : "read") << " temp file " << fileName << "\n";
+			abort();
+		}
+		done += got;
+	}
+	return done;
+}
+
+//background threads doing the reads and writes when io_uring isn't used
+//runs tasks in a fixed set of threads
+class ThreadPool
+{
+public:
+	ThreadPool(size_t numThreads) :
+		stopping(false)
+	{
+		for (size_t i = 0; i < numThreads; i++)
+		{
+			threads.emplace_back([this]() { work(); });
+		}
+	}
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wakeUp.notify_all();
+		for (size_t i = 0; i < threads.size(); i++)
+		{
+			threads[i].join();
+		}
+	}
+	std::future<size_t> run(std::function<size_t()> task)
+	{
+		std::packaged_task<size_t()> packaged(task);
+		std::future<size_t> ret = packaged.get_future();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			tasks.push_back(std::move(packaged));
+		}
+		wakeUp.notify_one();
+		return ret;
+	}
+private:
+	void work()
+	{
+		while (true)
+		{
+			std::packaged_task<size_t()> task;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wakeUp.wait(lock, [this]() { return stopping || !tasks.empty(); });
+				if (tasks.empty())
+				{
+					return;
+				}
+				task = std::move(tasks.front());
+				tasks.pop_front();
+			}
+			task();
+		}
+	}
+	std::vector<std::thread> threads;
+	std::deque<std::packaged_task<size_t()>> tasks;
+	std::mutex mutex;
+	std::condition_variable wakeUp;
+	bool stopping;
+};
+
+ThreadPool& ioThreads()
+{
+	static ThreadPool pool(4);
+	return pool;
+}
+
+size_t numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+
+void setNumThreads(size_t threads)
+{
+	assert(threads > 0);
+	numThreads = threads;
+}
+
+size_t getNumThreads()
+{
+	return numThreads;
+}
+
+//the calling thread works too, so the pool has one thread less
+ThreadPool& computeThreads()
+{
+	static ThreadPool pool(numThreads-1);
+	return pool;
+}
+
+void parallelFor(size_t count, const std::function<void(size_t)>& work)
+{
+	if (count == 0)
+	{
+		return;
+	}
+	std::atomic<size_t> next(0);
+	auto worker = [&next, count, &work]()
+	{
+		size_t i;
+		while ((i = next++) < count)
+		{
+			work(i);
+		}
+		return (size_t)0;
+	};
+	std::vector<std::future<size_t>> helpers;
+	for (size_t i = 1; i < std::min(count, numThreads); i++)
+	{
+		helpers.push_back(computeThreads().run(worker));
+	}
+	worker();
+	for (size_t i = 0; i < helpers.size(); i++)
+	{
+		helpers[i].get();
+	}
+}
+
+#ifdef IOURING
+//minimal io_uring through the raw system calls, so liburing isn't needed
+class IoUring
+{
+public:
+	IoUring() :
+		ringFd(-1)
+	{
+	}
+	~IoUring()
+	{
+		if (ringFd != -1)
+		{
+			munmap(sqes, sqesSize);
+			if (cqRing != sqRing)
+			{
+				munmap(cqRing, cqRingSize);
+			}
+			munmap(sqRing, sqRingSize);
+			close(ringFd);
+		}
+	}
+	//returns false if the kernel doesn't allow io_uring
+	bool setup(unsigned entries)
+	{
+		io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		ringFd = syscall(__NR_io_uring_setup, entries, &params);
+		if (ringFd < 0)
+		{
+			ringFd = -1;
+			return false;
+		}
+		sqRingSize = params.sq_off.array+params.sq_entries*sizeof(unsigned);
+		cqRingSize = params.cq_off.cqes+params.cq_entries*sizeof(io_uring_cqe);
+		if (params.features & IORING_FEAT_SINGLE_MMAP)
+		{
+			sqRingSize = std::max(sqRingSize, cqRingSize);
+			cqRingSize = sqRingSize;
+		}
+		sqRing = (char*)mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+		cqRing = sqRing;
+		if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+		{
+			cqRing = (char*)mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+		}
+		sqesSize = params.sq_entries*sizeof(io_uring_sqe);
+		sqes = (io_uring_sqe*)mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+		if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED)
+		{
+			std::cerr << "could not map io_uring\n";
+			abort();
+		}
+		sqTail = (unsigned*)(sqRing+params.sq_off.tail);
+		sqMask = (unsigned*)(sqRing+params.sq_off.ring_mask);
+		sqArray = (unsigned*)(sqRing+params.sq_off.array);
+		cqHead = (unsigned*)(cqRing+params.cq_off.head);
+		cqTail = (unsigned*)(cqRing+params.cq_off.tail);
+		cqMask = (unsigned*)(cqRing+params.cq_off.ring_mask);
+		cqes = (io_uring_cqe*)(cqRing+params.cq_off.cqes);
+		return true;
+	}
+	void submit(bool write, int fd, char* buffer, size_t bytes, size_t offset, uint64_t id)
+	{
+		unsigned tail = *sqTail;
+		unsigned index = tail & *sqMask;
+		io_uring_sqe* sqe = &sqes[index];
+		memset(sqe, 0, sizeof(io_uring_sqe));
+		sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+		sqe->fd = fd;
+		sqe->addr = (uint64_t)buffer;
+		sqe->len = bytes;
+		sqe->off = offset;
+		sqe->user_data = id;
+		sqArray[index] = index;
+		__atomic_store_n(sqTail, tail+1, __ATOMIC_RELEASE);
+		//the entry stays in the ring until the kernel has consumed it, so a failed submit is tried again
+		//there are never more operations in flight than the completion ring holds, so EBUSY and EAGAIN pass once the kernel has resources again
+		while (!enter(1, 0, 0))
+		{
+			std::this_thread::yield();
+		}
+	}
+	//blocks until some operation has completed
+	void reap(uint64_t& id, long& result)
+	{
+		while (true)
+		{
+			unsigned head = *cqHead;
+			if (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+			{
+				io_uring_cqe* cqe = &cqes[head & *cqMask];
+				id = cqe->user_data;
+				result = cqe->res;
+				__atomic_store_n(cqHead, head+1, __ATOMIC_RELEASE);
+				return;
+			}
+			enter(0, 1, IORING_ENTER_GETEVENTS);
+		}
+	}
+	static const unsigned depth = 16;
+private:
+	//returns false if the call should be made again
+	bool enter(unsigned toSubmit, unsigned minComplete, unsigned flags)
+	{
+		long result = syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, nullptr, 0);
+		if (result < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+		{
+			std::cerr << "could not enter io_uring\n";
+			abort();
+		}
+		return result >= 0 && (unsigned)result >= toSubmit;
+	}
+	int ringFd;
+	char* sqRing;
+	char* cqRing;
+	size_t sqRingSize;
+	size_t cqRingSize;
+	size_t sqesSize;
+	io_uring_sqe* sqes;
+	io_uring_cqe* cqes;
+	unsigned* sqTail;
+	unsigned* sqMask;
+	unsigned* sqArray;
+	unsigned* cqHead;
+	unsigned* cqTail;
+	unsigned* cqMask;
+};
+#else
+class IoUring
+{
+};
+#endif
+
+//open temp file descriptors, most recently used first
+struct OpenTempFiles
+{
+	std::mutex lock;
+	std::list<const AsyncFile*> recent;
+	size_t maxOpen = defaultMaxOpenTempFiles;
+};
+
+OpenTempFiles& openTempFiles()
+{
+	static OpenTempFiles files;
+	return files;
+}
+
+void setMaxOpenTempFiles(size_t count)
+{
+	assert(count > 0);
+	std::lock_guard<std::mutex> guard(openTempFiles().lock);
+	openTempFiles().maxOpen = count;
+}
+
+AsyncFile::AsyncFile(const std::string& fileName, bool truncate) :
+	fileName(fileName),
+	openFlags(O_RDWR | O_CREAT),
+	fd(-1),
+	users(0),
+	recentPosition(),
+	direct(ioBackend == DIRECT_IO),
+	ring(nullptr),
+	nextId(0),
+	operations()
+{
+	int flags = openFlags;
+	if (truncate)
+	{
+		flags |= O_TRUNC;
+	}
+	if (direct)
+	{
+		fd = open(fileName.c_str(), flags | O_DIRECT, 0600);
+		//not all file systems support direct I/O
+		if (fd == -1)
+		{
+			direct = false;
+		}
+		else
+		{
+			openFlags |= O_DIRECT;
+		}
+	}
+	if (fd == -1)
+	{
+		fd = open(fileName.c_str(), flags, 0600);
+	}
+	if (fd == -1)
+	{
+		std::cerr << "could not open temp file " << fileName << "\n";
+		abort();
+	}
+	{
+		std::lock_guard<std::mutex> guard(openTempFiles().lock);
+		openTempFiles().recent.push_front(this);
+		recentPosition = openTempFiles().recent.begin();
+		closeIdleDescriptors();
+	}
+#ifdef IOURING
+	ring = new IoUring;
+	if (!ring->setup(IoUring::depth))
+	{
+		delete ring;
+		ring = nullptr;
+	}
+#endif
+}
+
+AsyncFile::~AsyncFile()
+{
+	while (pending() > 0)
+	{
+		wait();
+	}
+	delete ring;
+	std::lock_guard<std::mutex> guard(openTempFiles().lock);
+	assert(users == 0);
+	closeDescriptor();
+}
+
+int AsyncFile::acquire() const
+{
+	OpenTempFiles& files = openTempFiles();
+	std::lock_guard<std::mutex> guard(files.lock);
+	users++;
+	if (fd == -1)
+	{
+		fd = open(fileName.c_str(), openFlags, 0600);
+		if (fd == -1)
+		{
+			std::cerr << "could not open temp file " << fileName << "\n";
+			abort();
+		}
+		files.recent.push_front(this);
+		recentPosition = files.recent.begin();
+	}
+	else
+	{
+		files.recent.splice(files.recent.begin(), files.recent, recentPosition);
+	}
+	closeIdleDescriptors();
+	return fd;
+}
+
+void AsyncFile::release() const
+{
+	std::lock_guard<std::mutex> guard(openTempFiles().lock);
+	assert(users > 0);
+	users--;
+}
+
+//the caller holds the lock of the open files
+void AsyncFile::closeIdleDescriptors()
+{
+	OpenTempFiles& files = openTempFiles();
+	auto i = files.recent.end();
+	while (files.recent.size() > files.maxOpen && i != files.recent.begin())
+	{
+		i--;
+		const AsyncFile* file = *i;
+		if (file->users == 0)
+		{
+			i++;
+			file->closeDescriptor();
+		}
+	}
+}
+
+//the caller holds the lock of the open files
+void AsyncFile::closeDescriptor() const
+{
+	if (fd == -1)
+	{
+		return;
+	}
+	openTempFiles().recent.erase(recentPosition);
+	close(fd);
+	fd = -1;
+}
+
+void AsyncFile::submitRead(char* buffer, size_t bytes, size_t offset)
+{
+	submit(false, buffer, bytes, offset);
+}
+
+void AsyncFile::submitWrite(const char* buffer, size_t bytes, size_t offset)
+{
+	submit(true, (char*)buffer, bytes, offset);
+}
+
+void AsyncFile::submit(bool write, char* buffer, size_t bytes, size_t offset)
+{
+	assert(!direct || ((size_t)buffer % ioAlignment == 0 && bytes % ioAlignment == 0 && offset % ioAlignment == 0));
+#ifdef IOURING
+	if (ring != nullptr && pending() == IoUring::depth)
+	{
+		wait();
+	}
+#endif
+	operations.emplace_back();
+	Operation& op = operations.back();
+	op.write = write;
+	op.buffer = buffer;
+	op.bytes = bytes;
+	op.offset = offset;
+	op.id = nextId;
+	//released when the operation is waited for
+	op.descriptor = acquire();
+	op.completed = false;
+	op.result = 0;
+	nextId++;
+	if (ring != nullptr)
+	{
+#ifdef IOURING
+		ring->submit(write, op.descriptor, buffer, bytes, offset, op.id);
+#endif
+		return;
+	}
+	int descriptor = op.descriptor;
+	std::string name = fileName;
+	op.threadResult = ioThreads().run([descriptor, write, buffer, bytes, offset, name]()
+	{
+		return transferAll(descriptor, write, buffer, bytes, offset, name);
+	});
+}
+
+size_t AsyncFile::wait()
+{
+	assert(pending() > 0);
+	Operation& op = operations.front();
+	size_t transferred;
+	if (ring == nullptr)
+	{
+		transferred = op.threadResult.get();
+	}
+	else
+	{
+#ifdef IOURING
+		while (!op.completed)
+		{
+			uint64_t id;
+			long result;
+			ring->reap(id, result);
+			assert(id >= op.id && id-op.id < operations.size());
+			operations[id-op.id].completed = true;
+			operations[id-op.id].result = result;
+		}
+#endif
+		//io_uring may transfer less than asked or not support the operation at all, the rest is done synchronously
+		transferred = op.result > 0 ? op.result : 0;
+		if (transferred < op.bytes && (op.write || op.result != 0))
+		{
+			transferred += transferAll(op.descriptor, op.write, op.buffer+transferred, op.bytes-transferred, op.offset+transferred, fileName);
+		}
+	}
+	operations.pop_front();
+	release();
+	return transferred;
+}
+
+size_t AsyncFile::readNow(char* buffer, size_t bytes, size_t offset) const
+{
+	int descriptor = acquire();
+	size_t transferred = transferAll(descriptor, false, buffer, bytes, offset, fileName);
+	release();
+	return transferred;
+}
+
+void AsyncFile::truncate(size_t size)
+{
+	assert(pending() == 0);
+	int descriptor = acquire();
+	if (ftruncate(descriptor, size) != 0)
+	{
+		std::cerr << "could not truncate temp file " << fileName << "\n";
+		abort();
+	}
+	release();
+}
+
+const size_t FileStreambuffer::maxBufferBytes;
+
+FileStreambuffer::FileStreambuffer(const std::string& fileName, Mode mode, size_t requestedBytes) :
+	std::streambuf(),
+	bufferBytes(std::max(ioAlignment, alignDown(requestedBytes))),
+	mode(mode),
+	file(new AsyncFile(fileName, mode == WRITE)),
+	currentBuffer(0),
+	fileOffset(0)
+{
+	buffers[0].resize(bufferBytes);
+	buffers[1].resize(bufferBytes);
+	if (mode == WRITE)
+	{
+		this->setp(buffers[0].data(), buffers[0].data()+bufferBytes);
+	}
+	else
+	{
+		//the first buffer is being read, the empty second one is the current get area
+		currentBuffer = 1;
+		startRead(0);
+		this->setg(buffers[1].data(), buffers[1].data(), buffers[1].data());
+	}
+}
+
+FileStreambuffer::~FileStreambuffer()
+{
+	close();
+}
+
+void FileStreambuffer::close()
+{
+	if (file == nullptr)
+	{
+		return;
+	}
+	if (mode == WRITE)
+	{
+		size_t used = this->pptr()-this->pbase();
+		while (file->pending() > 0)
+		{
+			file->wait();
+		}
+		if (used > 0)
+		{
+			//direct I/O can only write whole pages, the padding is cut off afterwards
+			size_t writeBytes = file->isDirect() ? alignUp(used) : used;
+			file->submitWrite(this->pbase(), writeBytes, fileOffset);
+			file->wait();
+			if (writeBytes != used)
+			{
+				file->truncate(fileOffset+used);
+			}
+		}
+		this->setp(nullptr, nullptr);
+	}
+	else
+	{
+		this->setg(nullptr, nullptr, nullptr);
+	}
+	delete file;
+	file = nullptr;
+	buffers[0].resize(0);
+	buffers[1].resize(0);
+}
+
+void FileStreambuffer::startRead(size_t buffer)
+{
+	file->submitRead(buffers[buffer].data(), bufferBytes, fileOffset);
+	fileOffset += bufferBytes;
+}
+
+FileStreambuffer::int_type FileStreambuffer::overflow(int_type ch)
+{
+	assert(mode == WRITE);
+	assert(this->pptr() == this->epptr());
+	file->submitWrite(buffers[currentBuffer].data(), bufferBytes, fileOffset);
+	fileOffset += bufferBytes;
+	currentBuffer = 1-currentBuffer;
+	//the other buffer's write must be done before it's filled again
+	while (file->pending() > 1)
+	{
+		file->wait();
+	}
+	this->setp(buffers[currentBuffer].data(), buffers[currentBuffer].data()+bufferBytes);
+	if (!traits_type::eq_int_type(ch, traits_type::eof()))
+	{
+		*this->pptr() = traits_type::to_char_type(ch);
+		this->pbump(1);
+	}
+	return traits_type::not_eof(ch);
+}
+
+FileStreambuffer::int_type FileStreambuffer::underflow()
+{
+	assert(mode == READ);
+	if (this->gptr() < this->egptr())
+	{
+		return traits_type::to_int_type(*this->gptr());
+	}
+	if (file->pending() == 0)
+	{
+		return traits_type::eof();
+	}
+	size_t got = file->wait();
+	currentBuffer = 1-currentBuffer;
+	if (got == bufferBytes)
+	{
+		startRead(1-currentBuffer);
+	}
+	this->setg(buffers[currentBuffer].data(), buffers[currentBuffer].data(), buffers[currentBuffer].data()+got);
+	if (got == 0)
+	{
+		return traits_type::eof();
+	}
+	return traits_type::to_int_type(*this->gptr());
+}
+
+std::streampos FileStreambuffer::seekpos(std::streampos sp, std::ios_base::openmode which)
+{
+	assert(mode == READ);
+	while (file->pending() > 0)
+	{
+		file->wait();
+	}
+	size_t position = sp;
+	fileOffset = position/bufferBytes*bufferBytes;
+	size_t skip = position-fileOffset;
+	currentBuffer = 1;
+	startRead(0);
+	this->setg(buffers[1].data(), buffers[1].data(), buffers[1].data());
+	underflow();
+	if (skip > (size_t)(this->egptr()-this->gptr()))
+	{
+		return std::streampos(std::streamoff(-1));
+	}
+	this->gbump(skip);
+	return sp;
+}
+
+MappedFile::MappedFile(const std::string& fileName) :
+	memory(nullptr),
+	bytes(0)
+{
+	int fd = open(fileName.c_str(), O_RDONLY);
+	struct stat info;
+	if (fd == -1 || fstat(fd, &info) != 0)
+	{
+		std::cerr << "could not open file " << fileName << "\n";
+		abort();
+	}
+	bytes = info.st_size;
+	//mapping an empty file fails
+	if (bytes > 0)
+	{
+		void* mapped = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+		if (mapped == MAP_FAILED)
+		{
+			std::cerr << "could not map file " << fileName << "\n";
+			abort();
+		}
+		memory = (char*)mapped;
+		madvise(memory, bytes, MADV_SEQUENTIAL);
+	}
+	::close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+void MappedFile::dropPages(size_t start, size_t end)
+{
+	assert(start <= end && end <= bytes);
+	if (memory != nullptr && alignDown(end) > alignUp(start))
+	{
+		madvise(memory+alignUp(start), alignDown(end)-alignUp(start), MADV_DONTNEED);
+	}
+}
+
+void MappedFile::close()
+{
+	if (memory != nullptr)
+	{
+		munmap(memory, bytes);
+	}
+	memory = nullptr;
+	bytes = 0;
+}
+
+MappedText::MappedText(const std::string& fileName, size_t zeroBytes) :
+	memory(nullptr),
+	bytes(0),
+	reservedBytes(0)
+{
+	int fd = open(fileName.c_str(), O_RDONLY);
+	struct stat info;
+	if (fd == -1 || fstat(fd, &info) != 0)
+	{
+		std::cerr << "could not open file " << fileName << "\n";
+		abort();
+	}
+	size_t fileBytes = info.st_size;
+	bytes = fileBytes+zeroBytes;
+	size_t pageBytes = sysconf(_SC_PAGESIZE);
+	reservedBytes = (bytes+pageBytes-1)/pageBytes*pageBytes;
+	if (reservedBytes > 0)
 	{
-		usable = true;
-		tryThis = "tmp" + std::to_string(nextTempFileName) + ".tmp";
-		nextTempFileName++;
-		std::ifstream fileExists(tryThis);
-		if (fileExists)
+		//the whole range is reserved as anonymous zero pages first and the file is mapped over its start
+		void* reserved = mmap(nullptr, reservedBytes, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (reserved == MAP_FAILED || (fileBytes > 0 && mmap(reserved, fileBytes, PROT_READ, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED))
 		{
-			usable = false;
-			fileExists.close();
-			continue;
+			std::cerr << "could not map file " << fileName << "\n";
+			abort();
 		}
-		std::ofstream canBeCreated(tryThis);
-		if (!canBeCreated)
+		memory = (char*)reserved;
+		advise(SEQUENTIAL);
+	}
+	::close(fd);
+}
+
+MappedText::~MappedText()
+{
+	close();
+}
+
+void MappedText::advise(Access access)
+{
+	if (memory == nullptr)
+	{
+		return;
+	}
+	switch(access)
+	{
+		case SEQUENTIAL:
+			madvise(memory, reservedBytes, MADV_SEQUENTIAL);
+			break;
+		case RANDOM:
+			madvise(memory, reservedBytes, MADV_RANDOM);
+			break;
+		case WILL_NEED:
+			madvise(memory, reservedBytes, MADV_WILLNEED);
+			break;
+	}
+}
+
+void MappedText::close()
+{
+	if (memory != nullptr)
+	{
+		munmap(memory, reservedBytes);
+	}
+	memory = nullptr;
+	bytes = 0;
+	reservedBytes = 0;
+}
+
+OutputFile::OutputFile(const std::string& fileName, size_t bytes) :
+	fileName(fileName),
+	fd(-1)
+{
+	fd = open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1 || ftruncate(fd, bytes) != 0)
+	{
+		std::cerr << "could not create file " << fileName << "\n";
+		abort();
+	}
+}
+
+OutputFile::~OutputFile()
+{
+	close();
+}
+
+void OutputFile::write(const char* data, size_t bytes, size_t offset)
+{
+	assert(fd != -1);
+	size_t done = 0;
+	while (done < bytes)
+	{
+		ssize_t got = pwrite(fd, data+done, bytes-done, offset+done);
+		if (got <= 0)
 		{
-			usable = false;
+			std::cerr << "could not write file " << fileName << "\n";
+			abort();
+		}
+		done += got;
+	}
+}
+
+void OutputFile::close()
+{
+	if (fd != -1)
+	{
+		::close(fd);
+	}
+	fd = -1;
+}
+
+SpillFile::Stripe::Stripe(const std::string& fileName, size_t bufferBytes) :
+	fileName(fileName),
+	file(fileName, true),
+	currentBuffer(0),
+	bufferStart(0),
+	bufferUsed(0),
+	fileEnd(0),
+	flushedEnd(0)
+{
+	assert(bufferBytes % ioAlignment == 0);
+	buffers[0].resize(bufferBytes);
+	buffers[1].resize(bufferBytes);
+}
+
+SpillFile::Stripe::~Stripe()
+{
+	while (file.pending() > 0)
+	{
+		file.wait();
+	}
+	remove(fileName.c_str());
+}
+
+SpillFile::SpillFile(size_t numWindows, size_t bufferBytes) :
+	stripes(),
+	nextStripe(0),
+	blocks(numWindows)
+{
+	//the buffer memory is split between the stripes, two buffers each, but a buffer is never smaller than a page
+	//if that leaves fewer stripes than directories, the stripes of different spill files go to different directories in turn
+	assert(bufferBytes >= 2*ioAlignment);
+	size_t numStripes = std::min(numTempDirectories(), bufferBytes/(2*ioAlignment));
+	size_t stripeBufferBytes = alignDown(bufferBytes/(2*numStripes));
+	for (size_t i = 0; i < numStripes; i++)
+	{
+		stripes.emplace_back(new Stripe(numStripes == numTempDirectories() ? getTempFileName(i) : getTempFileName(), stripeBufferBytes));
+	}
+}
+
+void SpillFile::writeBuffer(Stripe& stripe)
+{
+	assert(stripe.bufferUsed == stripe.buffers[stripe.currentBuffer].size());
+	stripe.file.submitWrite(stripe.buffers[stripe.currentBuffer].data(), stripe.bufferUsed, stripe.bufferStart);
+	stripe.bufferStart += stripe.bufferUsed;
+	stripe.bufferUsed = 0;
+	stripe.currentBuffer = 1-stripe.currentBuffer;
+	while (stripe.file.pending() > 1)
+	{
+		stripe.file.wait();
+	}
+}
+
+void SpillFile::appendBlock(size_t window, const char* data, size_t bytes)
+{
+	assert(window < blocks.size());
+	Stripe& stripe = *stripes[nextStripe];
+	Block block;
+	block.stripe = nextStripe;
+	block.offset = stripe.fileEnd;
+	block.bytes = bytes;
+	blocks[window].push_back(block);
+	nextStripe = (nextStripe+1) % stripes.size();
+	stripe.fileEnd += bytes;
+	while (bytes > 0)
+	{
+		size_t copy = std::min(bytes, stripe.buffers[stripe.currentBuffer].size()-stripe.bufferUsed);
+		memcpy(stripe.buffers[stripe.currentBuffer].data()+stripe.bufferUsed, data, copy);
+		stripe.bufferUsed += copy;
+		data += copy;
+		bytes -= copy;
+		if (stripe.bufferUsed == stripe.buffers[stripe.currentBuffer].size())
+		{
+			writeBuffer(stripe);
+		}
+	}
+}
+
+void SpillFile::flush()
+{
+	for (size_t i = 0; i < stripes.size(); i++)
+	{
+		flush(*stripes[i]);
+	}
+}
+
+void SpillFile::flush(Stripe& stripe)
+{
+	if (stripe.flushedEnd == stripe.fileEnd)
+	{
+		return;
+	}
+	AsyncFile& file = stripe.file;
+	while (file.pending() > 0)
+	{
+		file.wait();
+	}
+	if (stripe.bufferUsed > 0)
+	{
+		char* buffer = stripe.buffers[stripe.currentBuffer].data();
+		size_t used = stripe.bufferUsed;
+		file.submitWrite(buffer, file.isDirect() ? alignUp(used) : used, stripe.bufferStart);
+		file.wait();
+		if (file.isDirect())
+		{
+			//the partial last page stays in the buffer and is written again with the data appended after it
+			size_t keep = used-alignDown(used);
+			memmove(buffer, buffer+alignDown(used), keep);
+			stripe.bufferStart += alignDown(used);
+			stripe.bufferUsed = keep;
 		}
 		else
 		{
-			canBeCreated.close();
+			stripe.bufferStart += used;
+			stripe.bufferUsed = 0;
+		}
+	}
+	stripe.flushedEnd = stripe.fileEnd;
+}
+
+size_t SpillFile::numBlocks(size_t window) const
+{
+	assert(window < blocks.size());
+	return blocks[window].size();
+}
+
+SpillFile::Block SpillFile::block(size_t window, size_t block) const
+{
+	assert(window < blocks.size());
+	assert(block < blocks[window].size());
+	return blocks[window][block];
+}
+
+size_t SpillFile::numStripes() const
+{
+	return stripes.size();
+}
+
+void SpillFile::readBlock(Block block, char* dest) const
+{
+	assert(block.stripe < stripes.size());
+	const AsyncFile& file = stripes[block.stripe]->file;
+	if (!file.isDirect())
+	{
+		size_t got = file.readNow(dest, block.bytes, block.offset);
+		assert(got == block.bytes);
+		(void)got;
+		return;
+	}
+	size_t start = alignDown(block.offset);
+	size_t end = alignUp(block.offset+block.bytes);
+	AlignedBuffer aligned(end-start);
+	size_t got = file.readNow(aligned.data(), end-start, start);
+	assert(got >= block.offset+block.bytes-start);
+	(void)got;
+	memcpy(dest, aligned.data()+(block.offset-start), block.bytes);
+}
+
+//the blocks of a window are read only once, so the index can be dropped after that
+void SpillFile::forgetWindow(size_t window)
+{
+	assert(window < blocks.size());
+	freeMemory(blocks[window]);
+}
+
+void byteHistogram(const unsigned char* text, size_t textLen, size_t* counts)
+{
+	//eight tables so that runs of the same byte don't wait on one counter, 32-bit counters keep them small and are emptied before they overflow
+	const size_t flushInterval = (size_t)1 << 31;
+	std::vector<uint32_t> tables(8*256, 0);
+	uint32_t* table = tables.data();
+	size_t i = 0;
+	while (i < textLen)
+	{
+		size_t end = i+std::min(textLen-i, flushInterval);
+		for (; i+8 <= end; i += 8)
+		{
+			uint64_t word;
+			memcpy(&word, text+i, 8);
+			table[0*256+(word & 255)]++;
+			table[1*256+((word >> 8) & 255)]++;
+			table[2*256+((word >> 16) & 255)]++;
+			table[3*256+((word >> 24) & 255)]++;
+			table[4*256+((word >> 32) & 255)]++;
+			table[5*256+((word >> 40) & 255)]++;
+			table[6*256+((word >> 48) & 255)]++;
+			table[7*256+(word >> 56)]++;
+		}
+		for (; i < end; i++)
+		{
+			table[text[i]]++;
+		}
+		for (size_t a = 0; a < 256; a++)
+		{
+			for (size_t t = 0; t < 8; t++)
+			{
+				counts[a] += table[t*256+a];
+				table[t*256+a] = 0;
+			}
+		}
+	}
+}
+
+void compareNeighbourWordsScalar(const unsigned char* text, size_t words, uint64_t* less, uint64_t* greater)
+{
+	compareNeighbourWords<unsigned char>(text, words, less, greater);
+}
+
+#ifdef X86_KERNELS
+//bytes are compared as signed after flipping the top bit, which gives the unsigned order
+__attribute__((target("avx2")))
+void compareNeighbourWordsAVX2(const unsigned char* text, size_t words, uint64_t* less, uint64_t* greater)
+{
+	const __m256i flip = _mm256_set1_epi8((char)0x80);
+	for (size_t w = 0; w < words; w++)
+	{
+		uint64_t lessBits = 0;
+		uint64_t greaterBits = 0;
+		for (size_t half = 0; half < 2; half++)
+		{
+			const unsigned char* pos = text+64*w+32*half;
+			__m256i current = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)pos), flip);
+			__m256i next = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(pos+1)), flip);
+			lessBits |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpgt_epi8(next, current)) << (32*half);
+			greaterBits |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpgt_epi8(current, next)) << (32*half);
 		}
-	} while (!usable);
-	return tryThis;
+		less[w] = lessBits;
+		greater[w] = greaterBits;
+	}
+}
+
+__attribute__((target("sse2")))
+void compareNeighbourWordsSSE2(const unsigned char* text, size_t words, uint64_t* less, uint64_t* greater)
+{
+	const __m128i flip = _mm_set1_epi8((char)0x80);
+	for (size_t w = 0; w < words; w++)
+	{
+		uint64_t lessBits = 0;
+		uint64_t greaterBits = 0;
+		for (size_t quarter = 0; quarter < 4; quarter++)
+		{
+			const unsigned char* pos = text+64*w+16*quarter;
+			__m128i current = _mm_xor_si128(_mm_loadu_si128((const __m128i*)pos), flip);
+			__m128i next = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(pos+1)), flip);
+			lessBits |= (uint64_t)(uint32_t)_mm_movemask_epi8(_mm_cmpgt_epi8(next, current)) << (16*quarter);
+			greaterBits |= (uint64_t)(uint32_t)_mm_movemask_epi8(_mm_cmpgt_epi8(current, next)) << (16*quarter);
+		}
+		less[w] = lessBits;
+		greater[w] = greaterBits;
+	}
+}
+#endif
+
+typedef void (*CompareNeighbourWordsKernel)(const unsigned char*, size_t, uint64_t*, uint64_t*);
+
+CompareNeighbourWordsKernel pickCompareNeighbourWords()
+{
+#ifdef X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		return compareNeighbourWordsAVX2;
+	}
+	if (__builtin_cpu_supports("sse2"))
+	{
+		return compareNeighbourWordsSSE2;
+	}
+#endif
+	return compareNeighbourWordsScalar;
+}
+
+void compareNeighbourWords(const unsigned char* text, size_t words, uint64_t* less, uint64_t* greater)
+{
+	static const CompareNeighbourWordsKernel kernel = pickCompareNeighbourWords();
+	kernel(text, words, less, greater);
+}
+
+size_t firstMismatchBytesScalar(const unsigned char* first, const unsigned char* second, size_t bytes)
+{
+	size_t i = 0;
+	while (i < bytes && first[i] == second[i])
+	{
+		i++;
+	}
+	return i;
+}
+
+#ifdef X86_KERNELS
+__attribute__((target("avx2")))
+size_t firstMismatchBytesAVX2(const unsigned char* first, const unsigned char* second, size_t bytes)
+{
+	size_t i = 0;
+	for (; i+32 <= bytes; i += 32)
+	{
+		__m256i equal = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(first+i)), _mm256_loadu_si256((const __m256i*)(second+i)));
+		uint32_t differ = ~(uint32_t)_mm256_movemask_epi8(equal);
+		if (differ != 0)
+		{
+			return i+__builtin_ctz(differ);
+		}
+	}
+	return i+firstMismatchBytesScalar(first+i, second+i, bytes-i);
+}
+
+__attribute__((target("sse2")))
+size_t firstMismatchBytesSSE2(const unsigned char* first, const unsigned char* second, size_t bytes)
+{
+	size_t i = 0;
+	for (; i+16 <= bytes; i += 16)
+	{
+		__m128i equal = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(first+i)), _mm_loadu_si128((const __m128i*)(second+i)));
+		uint32_t differ = ~(uint32_t)_mm_movemask_epi8(equal) & 0xFFFF;
+		if (differ != 0)
+		{
+			return i+__builtin_ctz(differ);
+		}
+	}
+	return i+firstMismatchBytesScalar(first+i, second+i, bytes-i);
+}
+#endif
+
+typedef size_t (*FirstMismatchBytesKernel)(const unsigned char*, const unsigned char*, size_t);
+
+FirstMismatchBytesKernel pickFirstMismatchBytes()
+{
+#ifdef X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		return firstMismatchBytesAVX2;
+	}
+	if (__builtin_cpu_supports("sse2"))
+	{
+		return firstMismatchBytesSSE2;
+	}
+#endif
+	return firstMismatchBytesScalar;
+}
+
+size_t firstMismatchBytes(const unsigned char* first, const unsigned char* second, size_t bytes)
+{
+	static const FirstMismatchBytesKernel kernel = pickFirstMismatchBytes();
+	return kernel(first, second, bytes);
 }
 
 void bwt(const char* source, size_t sourceLen, char* dest)
@@ -64,3 +1349,13 @@ void bwtInFiles(const std::string& sourceFile, size_t maxMemory, const std::stri
 {
 	bwtInFiles<unsigned char>(sourceFile, 255, maxMemory, destFile);
 }
+
+void inverseBWTInFiles(const char* sourceFile, size_t maxMemory, const char* destFile)
+{
+	inverseBWTInFiles<unsigned char>(sourceFile, 255, maxMemory, destFile);
+}
+
+void inverseBWTInFiles(const std::string& sourceFile, size_t maxMemory, const std::string& destFile)
+{
+	inverseBWTInFiles<unsigned char>(sourceFile, 255, maxMemory, destFile);
+}
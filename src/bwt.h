@@ -12,6 +12,13 @@
 #include <fstream>
 #include <tuple>
 #include <algorithm>
+#include <future>
+#include <cstring>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <memory>
+#include <functional>
 
 //----------
 //use these
@@ -19,6 +26,8 @@ void bwt(const char* source, size_t sourceLen, char* dest);
 void inverseBWT(const char* source, size_t sourceLen, char* dest);
 void bwtInFiles(const char* sourceFile, size_t maxMemory, const char* destFile);
 void bwtInFiles(const std::string& sourceFile, size_t maxMemory, const std::string& destFile);
+void inverseBWTInFiles(const char* sourceFile, size_t maxMemory, const char* destFile);
+void inverseBWTInFiles(const std::string& sourceFile, size_t maxMemory, const std::string& destFile);
 //----------
 
 
@@ -30,16 +39,38 @@ void bwt(const Alphabet* source, size_t sourceLen, size_t maxAlphabet, Alphabet*
 template <class Alphabet>
 void bwt(const Alphabet* source, size_t sourceLen, size_t maxAlphabet, Alphabet* dest);
 
+//same result as bwt but with plain SA-IS in one array of sourceLen indices, dest may be the same as source
 template <class Alphabet, class IndexType>
-void bwtInFiles(const std::string& sourceFile, size_t sourceLen, size_t maxAlphabet, size_t maxMemory, const std::string& destFile, bool addSentinel);
+void bwtLean(const Alphabet* source, size_t sourceLen, size_t maxAlphabet, Alphabet* dest);
 
 template <class Alphabet>
-void bwtInFiles(const std::string& sourceFile, size_t sourceLen, size_t maxAlphabet, size_t maxMemory, const std::string& destFile, bool addSentinel);
+void bwtLean(const Alphabet* source, size_t sourceLen, size_t maxAlphabet, Alphabet* dest);
+
+//the rank of every suffix in text order, for the recursion of in-files BWT
+template <class Alphabet>
+void suffixRanksLean(std::vector<Alphabet>& source, size_t maxAlphabet, std::ostream& out, size_t ranksBytes);
+
+template <class Alphabet>
+size_t suffixRanksLeanPeakBytes(size_t sourceLen, size_t maxAlphabet);
+
+//with ranksBytes the inverse suffix array is written to destFile instead of the BWT, using ranksBytes bytes per rank
+template <class Alphabet, class IndexType>
+void bwtInFiles(const std::string& sourceFile, size_t sourceLen, size_t maxAlphabet, size_t maxMemory, const std::string& destFile, bool addSentinel, size_t ranksBytes = 0);
+
+template <class Alphabet>
+void bwtInFiles(const std::string& sourceFile, size_t sourceLen, size_t maxAlphabet, size_t maxMemory, const std::string& destFile, bool addSentinel, size_t ranksBytes = 0);
 
 template <class Alphabet>
 void bwtInFiles(const std::string& sourceFile, size_t maxAlphabet, size_t maxMemory, const std::string& destFile);
 
+//temp files go into a private directory which is created under each temp root on first use and removed at exit
+//the root is the current directory unless others are added, with several roots the files are spread over them
+void addTempDirectory(const std::string& root);
+size_t numTempDirectories();
+//names are numbered within the run directories, nothing is probed or created
+//without a directory the directories are used in turn
 std::string getTempFileName();
+std::string getTempFileName(size_t directory);
 
 template <class Type>
 std::vector<Type> readVectorFromFile(const std::string& sourceFile, bool addSentinel)
@@ -108,48 +139,350 @@ protected:
 	}
 };
 
+//number of threads used by the parallel parts, all hardware threads by default
+void setNumThreads(size_t threads);
+size_t getNumThreads();
+//runs work(0), ..., work(count-1) in the calling thread and the worker threads and returns when all are done
+//work must not call parallelFor
+void parallelFor(size_t count, const std::function<void(size_t)>& work);
+
+//how temp files are read and written
+//BUFFERED_IO goes through the page cache, DIRECT_IO bypasses it with O_DIRECT and aligned buffers
+//either way transfers are submitted asynchronously, with io_uring when compiled with -DIOURING and the kernel allows it, otherwise with background threads
+enum IOBackend { BUFFERED_IO, DIRECT_IO };
+void setIOBackend(IOBackend backend);
+IOBackend getIOBackend();
+
+//direct I/O buffers, sizes and file offsets must be multiples of this
+const size_t ioAlignment = 4096;
+
+inline size_t alignUp(size_t value)
+{
+	return (value+ioAlignment-1)/ioAlignment*ioAlignment;
+}
+
+inline size_t alignDown(size_t value)
+{
+	return value/ioAlignment*ioAlignment;
+}
+
+class AlignedBuffer
+{
+public:
+	AlignedBuffer();
+	explicit AlignedBuffer(size_t size);
+	AlignedBuffer(const AlignedBuffer& second) = delete;
+	AlignedBuffer& operator=(const AlignedBuffer& second) = delete;
+	~AlignedBuffer();
+	//doesn't keep the contents
+	void resize(size_t size);
+	char* data() const { return memory; };
+	size_t size() const { return bytes; };
+private:
+	char* memory;
+	size_t bytes;
+};
+
+//at most this many temp files keep their descriptor open, the least recently used idle ones are closed and reopened when accessed again
+//files with transfers in progress can't be closed, so the limit may be exceeded for a while
+const size_t defaultMaxOpenTempFiles = 64;
+void setMaxOpenTempFiles(size_t count);
+
+class IoUring;
+
+//a temp file with a queue of asynchronous reads and writes which are waited for in the order they were submitted
+class AsyncFile
+{
+public:
+	AsyncFile(const std::string& fileName, bool truncate);
+	AsyncFile(const AsyncFile& second) = delete;
+	AsyncFile& operator=(const AsyncFile& second) = delete;
+	~AsyncFile();
+	//the buffer must stay untouched until the operation has been waited for
+	//reads stop at the end of the file, so they may transfer less than asked
+	void submitRead(char* buffer, size_t bytes, size_t offset);
+	void submitWrite(const char* buffer, size_t bytes, size_t offset);
+	//waits for the oldest unfinished operation and returns how many bytes it transferred
+	size_t wait();
+	size_t pending() const { return operations.size(); };
+	//synchronous read which can be called from any thread
+	size_t readNow(char* buffer, size_t bytes, size_t offset) const;
+	void truncate(size_t size);
+	bool isDirect() const { return direct; };
+private:
+	struct Operation
+	{
+		bool write;
+		char* buffer;
+		size_t bytes;
+		size_t offset;
+		uint64_t id;
+		int descriptor;
+		bool completed;
+		long result;
+		std::future<size_t> threadResult;
+	};
+	void submit(bool write, char* buffer, size_t bytes, size_t offset);
+	//descriptors are pinned open while they are used
+	int acquire() const;
+	void release() const;
+	void closeDescriptor() const;
+	static void closeIdleDescriptors();
+	std::string fileName;
+	int openFlags;
+	mutable int fd;
+	mutable size_t users;
+	mutable std::list<const AsyncFile*>::iterator recentPosition;
+	bool direct;
+	IoUring* ring;
+	uint64_t nextId;
+	std::deque<Operation> operations;
+};
+
+//sequential reading or writing of a temp file through two buffers, one is transferred in the background while the other one is used
+class FileStreambuffer : public std::streambuf
+{
+public:
+	enum Mode { READ, WRITE };
+	static const size_t maxBufferBytes = 1 << 18;
+	//bufferBytes is the size of each of the two buffers, rounded to whole pages
+	FileStreambuffer(const std::string& fileName, Mode mode, size_t bufferBytes = maxBufferBytes);
+	FileStreambuffer(const FileStreambuffer& second) = delete;
+	FileStreambuffer& operator=(const FileStreambuffer& second) = delete;
+	~FileStreambuffer();
+	void close();
+protected:
+	int_type overflow(int_type ch);
+	int_type underflow();
+	std::streampos seekpos(std::streampos sp, std::ios_base::openmode which = std::ios_base::in | std::ios_base::out);
+private:
+	void startRead(size_t buffer);
+	size_t bufferBytes;
+	Mode mode;
+	AsyncFile* file;
+	AlignedBuffer buffers[2];
+	size_t currentBuffer;
+	size_t fileOffset;
+};
+
+//read-only view of a whole file through mmap, so a file can be scanned several times while it is read from disk only once
+class MappedFile
+{
+public:
+	explicit MappedFile(const std::string& fileName);
+	MappedFile(const MappedFile& second) = delete;
+	MappedFile& operator=(const MappedFile& second) = delete;
+	~MappedFile();
+	const char* data() const { return memory; };
+	size_t size() const { return bytes; };
+	//drops the whole pages within [start, end) from the resident set, the file stays readable
+	void dropPages(size_t start, size_t end);
+	//drops the mapping early
+	void close();
+private:
+	char* memory;
+	size_t bytes;
+};
+
+//read-only view of a text file through mmap with zeroBytes zero bytes after the file's end, where an added sentinel is read from
+//the zeros are the rest of the file's last page or an anonymous page after it, so the text is never copied and its pages are the page cache's
+class MappedText
+{
+public:
+	enum Access { SEQUENTIAL, RANDOM, WILL_NEED };
+	MappedText(const std::string& fileName, size_t zeroBytes);
+	MappedText(const MappedText& second) = delete;
+	MappedText& operator=(const MappedText& second) = delete;
+	~MappedText();
+	const char* data() const { return memory; };
+	//the file's bytes and the zero bytes
+	size_t size() const { return bytes; };
+	//tells the kernel how the text is read next
+	void advise(Access access);
+	//drops the mapping early
+	void close();
+private:
+	char* memory;
+	size_t bytes;
+	size_t reservedBytes;
+};
+
+//an output file of a known size which is written in pieces at any offsets
+class OutputFile
+{
+public:
+	//creates the file with bytes zero bytes
+	OutputFile(const std::string& fileName, size_t bytes);
+	OutputFile(const OutputFile& second) = delete;
+	OutputFile& operator=(const OutputFile& second) = delete;
+	~OutputFile();
+	void write(const char* data, size_t bytes, size_t offset);
+	void close();
+private:
+	std::string fileName;
+	int fd;
+};
+
+//append-only temp files for the spilled items of all windows of a WeirdPriorityQueue
+//blocks are appended so writes are sequential, and an in-memory index remembers which blocks belong to which window
+//there is one file, a stripe, per temp directory and blocks go to the stripes in turn, so every window is spread over all of them
+//appended data is collected into two buffers per stripe, a full buffer is written in the background while the other one is filled
+class SpillFile
+{
+public:
+	struct Block { size_t offset; uint32_t stripe; uint32_t bytes; };
+	//bufferBytes is the size of all write buffers of all stripes together, at least two pages
+	//every buffer is at least a page, so with many temp directories and a small budget there are fewer stripes than directories
+	SpillFile(size_t numWindows, size_t bufferBytes);
+	SpillFile(const SpillFile& second) = delete;
+	SpillFile& operator=(const SpillFile& second) = delete;
+	void appendBlock(size_t window, const char* data, size_t bytes);
+	size_t numBlocks(size_t window) const;
+	Block block(size_t window, size_t block) const;
+	size_t numStripes() const;
+	//writes everything appended so far so it can be read with readBlock
+	void flush();
+	//safe to call from another thread while blocks are appended, as long as the block was flushed beforehand
+	void readBlock(Block block, char* dest) const;
+	void forgetWindow(size_t window);
+private:
+	struct Stripe
+	{
+		Stripe(const std::string& fileName, size_t bufferBytes);
+		~Stripe();
+		std::string fileName;
+		AsyncFile file;
+		AlignedBuffer buffers[2];
+		size_t currentBuffer;
+		size_t bufferStart;
+		size_t bufferUsed;
+		size_t fileEnd;
+		size_t flushedEnd;
+	};
+	void writeBuffer(Stripe& stripe);
+	void flush(Stripe& stripe);
+	std::vector<std::unique_ptr<Stripe>> stripes;
+	size_t nextStripe;
+	std::vector<std::vector<Block>> blocks;
+};
+
 //memory usage reduction trick from the end of paper's section 5
 template <class ItemType, class PriorityType>
 class WeirdPriorityQueue
 {
 private:
 	struct WriteType { ItemType item; PriorityType priority; };
+	//spilled blocks are stored as a codec byte, the number of items as a varint, the items packed without padding, and then the priorities relative to the start of the window
+	//the priorities are either fixed width, using as few bytes as the window size allows, or delta+varint coded, whichever is smaller
+	enum BlockCodec { FIXED_WIDTH = 0, DELTA_VARINT = 1 };
+	static const size_t maxBlockBytes = 1 << 22;
+	static const size_t maxSpillBufferBytes = 1 << 21;
+	//blocks are at least a page of items, so they are read with few big reads and the index of the blocks stays small
+	static size_t minBlockItems()
+	{
+		return ioAlignment/sizeof(WriteType);
+	}
+	//the spill file's write buffers together, very small budgets still get the two aligned pages the spill file needs
+	static size_t spillBufferBytes(size_t maxBytes)
+	{
+		return std::max(2*ioAlignment, alignDown(std::min(maxBytes/8, (size_t)maxSpillBufferBytes)));
+	}
+	struct Layout
+	{
+		size_t windowItems;
+		size_t blockItems;
+		size_t collectBytes;
+		size_t spillBufferBytes;
+		size_t readAheadBytes;
+		size_t indexBytes;
+	};
+	//a quarter of the memory is used for reading the next window in the background while the current one is processed,
+	//an eighth for collecting spilled items of the other windows into blocks, up to another eighth for writing the blocks,
+	//enough for the index of the spilled blocks, and the rest for the window and its used flags
+	//a block is written when it's full, or when the collected items fill their memory and it's the largest one,
+	//so if every window can collect a block of at least a page no smaller blocks are written
+	//budgets too small for that are raised until it fits, they would otherwise write blocks of a few items with an index entry each
+	static Layout layout(size_t maxPriority, size_t maxBytes)
+	{
+		size_t bytes = maxBytes;
+		while (true)
+		{
+			Layout ret;
+			ret.readAheadBytes = bytes/4;
+			ret.collectBytes = bytes/8;
+			ret.spillBufferBytes = spillBufferBytes(bytes);
+			size_t otherBytes = ret.readAheadBytes+ret.collectBytes+ret.spillBufferBytes;
+			//the index depends on the window size which depends on the index, so the window is sized again until the index it needs fits
+			ret.indexBytes = 0;
+			for (int round = 0; round < 8 && bytes > otherBytes+ret.indexBytes+ioAlignment; round++)
+			{
+				ret.windowItems = (bytes-otherBytes-ret.indexBytes)*8/(8*sizeof(ItemType)+1);
+				size_t numWindows = (maxPriority+ret.windowItems-1)/ret.windowItems;
+				//the vectors of the partial blocks hold up to twice their items
+				size_t windowCollectItems = ret.collectBytes/sizeof(WriteType)/std::max(numWindows, (size_t)1)/2;
+				ret.blockItems = std::min(std::min(std::max(windowCollectItems, minBlockItems()), maxBlockBytes/sizeof(WriteType)), ret.windowItems);
+				size_t smallestBlock = std::max((size_t)1, std::min(windowCollectItems, ret.blockItems));
+				size_t indexBytes = (maxPriority/smallestBlock+numWindows)*sizeof(SpillFile::Block);
+				if (indexBytes <= ret.indexBytes)
+				{
+					if (numWindows <= 1 || smallestBlock >= std::min(minBlockItems(), ret.windowItems))
+					{
+						return ret;
+					}
+					break;
+				}
+				ret.indexBytes = indexBytes;
+			}
+			bytes += bytes/8+ioAlignment;
+		}
+	}
+	static size_t priorityWidth(size_t k)
+	{
+		if (k <= (size_t)1 << 8)
+		{
+			return 1;
+		}
+		if (k <= (size_t)1 << 16)
+		{
+			return 2;
+		}
+		if (k <= (size_t)1 << 32)
+		{
+			return 4;
+		}
+		return 8;
+	}
 public:
 	WeirdPriorityQueue(size_t maxPriority, size_t maxBytes) :
+		sizes(layout(maxPriority, maxBytes)),
 		numItems(0),
-		k(maxBytes/sizeof(ItemType)),
+		k(sizes.windowItems),
 		currentStart(0),
 		currentPos(0),
 		currentEnd(k),
 		maxPriority(maxPriority),
+		blockLength(sizes.blockItems),
 		currentItems(k),
 		used(k, false),
-		fileNames(),
-		streams()
+		pending((maxPriority+k-1)/k),
+		pendingOfSize(blockLength, (size_t)noWindow),
+		pendingNext((maxPriority+k-1)/k, (size_t)noWindow),
+		pendingPrevious((maxPriority+k-1)/k, (size_t)noWindow),
+		largestPending(0),
+		pendingCapacity(0),
+		spill((maxPriority+k-1)/k, sizes.spillBufferBytes),
+		encoded(),
+		maxReadAheadBytes(sizes.readAheadBytes),
+		readAheadWindow(0),
+		readAheadBlocks(),
+		readAheadData(),
+		readAhead()
 	{
-		size_t maxFile = (maxPriority+k-1)/k;
-		for (size_t i = 0; i < maxFile; i++)
-		{
-			fileNames.push_back(getTempFileName());
-			std::fstream* stream = new std::fstream(fileNames.back(), std::ios_base::in | std::ios_base::out | std::ios_base::binary);
-			assert(stream->good());
-			streams.push_back(stream);
-		}
 	};
 	WeirdPriorityQueue(const WeirdPriorityQueue& second) = delete;
 	WeirdPriorityQueue& operator=(const WeirdPriorityQueue& second) = delete;
 	WeirdPriorityQueue(WeirdPriorityQueue&& second) = delete;
 	WeirdPriorityQueue& operator=(WeirdPriorityQueue&& second) = delete;
-	~WeirdPriorityQueue()
-	{
-		assert(fileNames.size() == streams.size());
-		for (size_t i = 0; i < fileNames.size(); i++)
-		{
-			streams[i]->close();
-			delete streams[i];
-			remove(fileNames[i].c_str());
-		}
-	};
 	ItemType get()
 	{
 		assert(currentPos <= k);
@@ -163,23 +496,13 @@ public:
 			currentStart += k;
 			currentEnd += k;
 			size_t fileN = currentStart/k;
-			assert(fileN < streams.size());
-			streams[fileN]->flush();
-			streams[fileN]->seekg(0, std::ios::beg);
-			while (true)
-			{
-				WriteType read;
-				assert(streams[fileN]->good());
-				streams[fileN]->read((char*)&read, sizeof(WriteType));
-				if (streams[fileN]->eof())
-				{
-					break;
-				}
-				assert(read.priority >= currentStart);
-				assert(read.priority < currentEnd);
-				currentItems[read.priority-currentStart] = read.item;
-				used[read.priority-currentStart] = true;
-			}
+			assert(fileN < pending.size());
+			loadWindow(fileN);
+			startReadAhead(fileN+1);
+		}
+		else if (currentStart == 0 && currentPos == 0 && readAheadWindow == 0)
+		{
+			startReadAhead(1);
 		}
 		while (!used[currentPos])
 		{
@@ -209,271 +532,898 @@ public:
 		write.item = item;
 		write.priority = priority;
 		size_t fileN = priority/k;
-		assert(fileN < streams.size());
-		assert(streams[fileN]->good());
-		streams[fileN]->write((char*)&write, sizeof(WriteType));
-	};
-	size_t size() { return numItems; };
-	bool empty() { return numItems == 0; };
-private:
-	size_t numItems;
-	size_t k;
-	size_t currentStart;
-	size_t currentPos;
-	size_t currentEnd;
-	size_t maxPriority;
-	std::vector<ItemType> currentItems;
-	std::vector<bool> used;
-	std::vector<std::string> fileNames;
-	std::vector<std::fstream*> streams;
-};
-
-template <class Alphabet>
-std::vector<size_t> charSums(const Alphabet* text, size_t textLen, size_t maxAlphabet)
-{
-	std::vector<size_t> sums(maxAlphabet+1, 0);
-	for (size_t i = 0; i < textLen; i++)
-	{
-		assert(text[i] <= maxAlphabet);
-		sums[text[i]]++;
-	}
-	std::vector<size_t> ret(maxAlphabet+2, 0);
-	for (size_t i = 1; i < maxAlphabet+2; i++)
-	{
-		ret[i] = ret[i-1]+sums[i-1];
-	}
-	return ret;
-}
-
-//returns random access written results in the tuple, and sequential access written results with streams
-template <class Alphabet, class IndexType>
-std::tuple<std::vector<IndexType>, //L-counts
-           size_t               //count of LMS-type indices
-#ifndef NDEBUG
-           ,std::vector<bool> //is S-type
-#endif
-           > 
-preprocess(std::istream& text, size_t textLen, size_t maxAlphabet, std::ostream& LMSLeftOut, std::ostream& charSumOut, std::ostream& LMSIndicesOut, bool addSentinel)
-{
-	std::tuple<std::vector<IndexType>, 
-	           size_t
-#ifndef NDEBUG
-	           ,std::vector<bool>
-#endif
-	           > ret;
-	std::get<0>(ret).resize(maxAlphabet+1, 0);
-	std::get<1>(ret) = 0;
-#ifndef NDEBUG
-	std::get<2>(ret).resize(textLen, false);
-#endif
-	std::vector<IndexType> sums(maxAlphabet+1, 0);
-	std::vector<std::vector<IndexType>> buckets(maxAlphabet+1);
-	IndexType lastPossibleLMS = 0;
-	IndexType lastCharacterBoundary = 0;
-	bool lastWasLType = false;
-	Alphabet currentSymbol;
-	Alphabet nextSymbol;
-	text.read((char*)&nextSymbol, sizeof(Alphabet));
-	for (size_t i = 0; i < textLen-1; i++)
-	{
-		currentSymbol = nextSymbol;
-		if (addSentinel && i == textLen-2)
+		assert(fileN < pending.size());
+		std::vector<WriteType>& block = pending[fileN];
+		unlinkPending(fileN);
+		if (block.size() == block.capacity())
 		{
-			nextSymbol = 0;
+			pendingCapacity -= block.capacity();
+			block.reserve(std::min(std::max((size_t)1, 2*block.capacity()), blockLength));
+			pendingCapacity += block.capacity();
 		}
-		else
+		block.push_back(write);
+		if (block.size() == blockLength)
 		{
-			text.read((char*)&nextSymbol, sizeof(Alphabet));
+			spillPending(fileN);
 		}
-		assert(currentSymbol <= maxAlphabet);
-		sums[currentSymbol]++;
-		if (currentSymbol > nextSymbol)
+		else
 		{
-			//L-type, and all in [lastCharacterBoundary, i] are L-type of the same letter
-			assert(i >= lastCharacterBoundary);
-			std::get<0>(ret)[currentSymbol] += (i-lastCharacterBoundary)+1;
-			lastPossibleLMS = i+1;
-			lastCharacterBoundary = i+1;
-			lastWasLType = true;
+			linkPending(fileN);
 		}
-		else if (currentSymbol < nextSymbol)
+		while (pendingCapacity*sizeof(WriteType) > sizes.collectBytes)
 		{
-			//S-type, and all in [lastCharacterBoundary, i] are S-type of the same letter
-#ifndef NDEBUG
-			for (size_t a = lastCharacterBoundary; a <= i; a++)
+			while (largestPending > 0 && pendingOfSize[largestPending] == noWindow)
 			{
-				std::get<2>(ret)[a] = true;
+				largestPending--;
 			}
-#endif
-			if (lastWasLType)
+			if (largestPending == 0)
 			{
-				buckets[currentSymbol].push_back(lastPossibleLMS);
-				LMSIndicesOut.write((char*)&lastPossibleLMS, sizeof(IndexType));
-				assert(std::get<1>(ret) < textLen/2);
-				std::get<1>(ret)++;
+				break;
 			}
-			lastWasLType = false;
-			lastCharacterBoundary = i+1;
+			size_t largest = pendingOfSize[largestPending];
+			unlinkPending(largest);
+			spillPending(largest);
 		}
-		else
+	};
+	size_t size() { return numItems; };
+	bool empty() { return numItems == 0; };
+private:
+	static const size_t noWindow = std::numeric_limits<size_t>::max();
+	//the windows with a partial block are in doubly linked lists by the block's size, so the largest one is found quickly
+	//largestPending is only an upper bound of the sizes, it's lowered when the largest block is needed
+	void linkPending(size_t window)
+	{
+		size_t size = pending[window].size();
+		assert(size > 0 && size < blockLength);
+		pendingPrevious[window] = noWindow;
+		pendingNext[window] = pendingOfSize[size];
+		if (pendingOfSize[size] != noWindow)
 		{
-			assert(currentSymbol == nextSymbol);
+			pendingPrevious[pendingOfSize[size]] = window;
 		}
+		pendingOfSize[size] = window;
+		largestPending = std::max(largestPending, size);
 	}
-	for (size_t i = 0; i < maxAlphabet+1; i++)
+	void unlinkPending(size_t window)
 	{
-		assert(std::get<0>(ret)[i] <= sums[i]);
+		size_t size = pending[window].size();
+		if (size == 0)
+		{
+			return;
+		}
+		if (pendingPrevious[window] != noWindow)
+		{
+			pendingNext[pendingPrevious[window]] = pendingNext[window];
+		}
+		else
+		{
+			assert(pendingOfSize[size] == window);
+			pendingOfSize[size] = pendingNext[window];
+		}
+		if (pendingNext[window] != noWindow)
+		{
+			pendingPrevious[pendingNext[window]] = pendingPrevious[window];
+		}
 	}
-#ifndef NDEBUG
-	std::get<2>(ret)[textLen-1] = true;
-#endif
-	sums[nextSymbol]++;
-	buckets[nextSymbol].push_back(textLen-1);
-	IndexType lastIndex = textLen-1;
-	LMSIndicesOut.write((char*)&lastIndex, sizeof(IndexType));
-	assert(std::get<1>(ret) < textLen/2);
-	std::get<1>(ret)++;
-
-	assert(maxAlphabet+1 < std::numeric_limits<int>::max());
-	IndexType charSumSum = 0;
-	charSumOut.write((char*)&charSumSum, sizeof(IndexType));
-	for (int i = 0; i < maxAlphabet+1; i++)
+	//writes the window's collected items into the spill file as one block, the window must not be in the lists
+	void spillPending(size_t window)
 	{
-		charSumSum = charSumSum+sums[i];
-		charSumOut.write((char*)&charSumSum, sizeof(IndexType));
-		LMSLeftOut.write((char*)buckets[i].data(), buckets[i].size()*sizeof(IndexType));
-		freeMemory(buckets[i]);
+		std::vector<WriteType>& block = pending[window];
+		assert(block.size() > 0);
+		size_t bytes = encodeBlock(block, window*k);
+		spill.appendBlock(window, encoded.data(), bytes);
+		pendingCapacity -= block.capacity();
+		freeMemory(block);
 	}
-
-	return ret;
-}
-
-template <class Alphabet, class IndexType>
-std::tuple<std::vector<IndexType>, //L-counts
-           std::vector<IndexType>, //charSum
-           size_t               //count of LMS-type indices
-#ifndef NDEBUG
-           ,std::vector<bool> //is S-type
-#endif
-           > 
-preprocessLowMemory(std::istream& text, size_t textLen, size_t maxAlphabet, size_t k, std::ostream& LMSLeftOut, std::ostream& LMSIndicesOut, bool addSentinel)
-{
-	std::tuple<std::vector<IndexType>, 
-	           std::vector<IndexType>,
-	           size_t
-#ifndef NDEBUG
-	           ,std::vector<bool>
-#endif
-	           > ret;
-	std::get<0>(ret).resize(maxAlphabet+1, 0);
-	std::get<1>(ret).resize(maxAlphabet+2, 0);
-	std::get<2>(ret) = 0;
-#ifndef NDEBUG
-	std::get<3>(ret).resize(textLen, false);
-#endif
-	std::vector<IndexType> sums(maxAlphabet+1, 0);
-	//two passes, first calculate how many times each symbol appears. This is necessary for calculating where each LMS index would go in the LMSleft array
-	for (size_t i = 0; i < textLen-1; i++)
+	static void writeVarint(char*& pos, uint64_t value)
 	{
-		Alphabet symbol;
-		text.read((char*)&symbol, sizeof(Alphabet));
-		sums[symbol]++;
+		while (value >= 128)
+		{
+			*pos = (char)((value & 127) | 128);
+			value >>= 7;
+			pos++;
+		}
+		*pos = (char)value;
+		pos++;
 	}
-	if (addSentinel)
+	static uint64_t readVarint(const unsigned char*& pos)
 	{
-		sums[0]++;
+		uint64_t value = 0;
+		size_t shift = 0;
+		while (*pos & 128)
+		{
+			value |= (uint64_t)(*pos & 127) << shift;
+			shift += 7;
+			pos++;
+		}
+		value |= (uint64_t)*pos << shift;
+		pos++;
+		return value;
 	}
-	else
+	static size_t varintBytes(uint64_t value)
 	{
-		Alphabet symbol;
-		text.read((char*)&symbol, sizeof(Alphabet));
-		sums[symbol]++;
+		size_t ret = 1;
+		while (value >= 128)
+		{
+			value >>= 7;
+			ret++;
+		}
+		return ret;
 	}
-	for (size_t i = 1; i < maxAlphabet+2; i++)
+	static uint64_t zigzagDelta(size_t relative, size_t previous)
 	{
-		std::get<1>(ret)[i] = std::get<1>(ret)[i-1]+sums[i-1];
+		int64_t delta = (int64_t)relative-(int64_t)previous;
+		return ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63);
 	}
-	freeMemory(sums);
-	text.clear();
-	text.seekg(0, std::ios::beg);
-	assert(text.good());
-	WeirdPriorityQueue<IndexType, IndexType> LMSLeft(textLen, k);
-	std::vector<IndexType> indicesWritten(maxAlphabet+1, 0);
-	IndexType lastPossibleLMS = 0;
-	IndexType lastCharacterBoundary = 0;
-	bool lastWasLType = false;
-	Alphabet currentSymbol;
-	Alphabet nextSymbol;
-	text.read((char*)&nextSymbol, sizeof(Alphabet));
-	for (size_t i = 0; i < textLen-1; i++)
+	//encodes the block into encoded and returns the encoded size
+	size_t encodeBlock(const std::vector<WriteType>& block, size_t windowStart)
 	{
-		currentSymbol = nextSymbol;
-		if (addSentinel && i == textLen-2)
+		size_t width = priorityWidth(k);
+		size_t fixedBytes = block.size()*width;
+		size_t varintTotal = 0;
+		size_t previous = 0;
+		for (size_t i = 0; i < block.size(); i++)
 		{
-			nextSymbol = 0;
+			varintTotal += varintBytes(zigzagDelta(block[i].priority-windowStart, previous));
+			previous = block[i].priority-windowStart;
 		}
-		else
+		BlockCodec codec = varintTotal < fixedBytes ? DELTA_VARINT : FIXED_WIDTH;
+		size_t bytes = 1+varintBytes(block.size())+block.size()*sizeof(ItemType)+(codec == DELTA_VARINT ? varintTotal : fixedBytes);
+		encoded.resize(bytes);
+		char* pos = encoded.data();
+		*pos = (char)codec;
+		pos++;
+		writeVarint(pos, block.size());
+		for (size_t i = 0; i < block.size(); i++)
 		{
-			text.read((char*)&nextSymbol, sizeof(Alphabet));
+			memcpy(pos, &block[i].item, sizeof(ItemType));
+			pos += sizeof(ItemType);
 		}
-		assert(currentSymbol <= maxAlphabet);
-		if (currentSymbol > nextSymbol)
+		previous = 0;
+		for (size_t i = 0; i < block.size(); i++)
 		{
-			//L-type, and all in [lastCharacterBoundary, i] are L-type of the same letter
-			assert(i >= lastCharacterBoundary);
-			std::get<0>(ret)[currentSymbol] += (i-lastCharacterBoundary)+1;
-			lastPossibleLMS = i+1;
-			lastCharacterBoundary = i+1;
-			lastWasLType = true;
+			uint64_t relative = block[i].priority-windowStart;
+			if (codec == FIXED_WIDTH)
+			{
+				//little endian, lowest bytes first
+				for (size_t b = 0; b < width; b++)
+				{
+					*pos = (char)(relative >> (8*b));
+					pos++;
+				}
+			}
+			else
+			{
+				writeVarint(pos, zigzagDelta(relative, previous));
+				previous = relative;
+			}
 		}
-		else if (currentSymbol < nextSymbol)
+		assert(pos == encoded.data()+bytes);
+		return bytes;
+	}
+	//decodes a block of the current window straight into the window
+	void placeBlock(const char* data, size_t bytes)
+	{
+		size_t width = priorityWidth(k);
+		BlockCodec codec = (BlockCodec)*data;
+		const unsigned char* countPos = (const unsigned char*)data+1;
+		size_t count = readVarint(countPos);
+		assert(count > 0 && count <= blockLength);
+		const char* itemPos = (const char*)countPos;
+		const unsigned char* priorityPos = (const unsigned char*)(itemPos+count*sizeof(ItemType));
+		uint64_t previous = 0;
+		for (size_t i = 0; i < count; i++)
 		{
-			//S-type, and all in [lastCharacterBoundary, i] are S-type of the same letter
-#ifndef NDEBUG
-			for (size_t a = lastCharacterBoundary; a <= i; a++)
+			uint64_t relative = 0;
+			if (codec == FIXED_WIDTH)
 			{
-				std::get<3>(ret)[a] = true;
+				for (size_t b = 0; b < width; b++)
+				{
+					relative |= (uint64_t)priorityPos[b] << (8*b);
+				}
+				priorityPos += width;
 			}
-#endif
-			if (lastWasLType)
+			else
 			{
-				LMSLeft.insert(lastPossibleLMS, std::get<1>(ret)[currentSymbol]+indicesWritten[currentSymbol]);
-				indicesWritten[currentSymbol]++;
-				LMSIndicesOut.write((char*)&lastPossibleLMS, sizeof(IndexType));
-				assert(std::get<2>(ret) < textLen/2);
-				std::get<2>(ret)++;
+				assert(codec == DELTA_VARINT);
+				uint64_t value = readVarint(priorityPos);
+				relative = previous+(int64_t)((value >> 1) ^ (~(value & 1)+1));
+				previous = relative;
 			}
-			lastWasLType = false;
-			lastCharacterBoundary = i+1;
+			assert(relative < k);
+			memcpy(&currentItems[relative], itemPos, sizeof(ItemType));
+			itemPos += sizeof(ItemType);
+			used[relative] = true;
 		}
-		else
+		assert((const char*)priorityPos == data+bytes);
+	}
+	void placeItems(const WriteType* items, size_t count)
+	{
+		for (size_t i = 0; i < count; i++)
 		{
-			assert(currentSymbol == nextSymbol);
+			assert(items[i].priority >= currentStart);
+			assert(items[i].priority < currentEnd);
+			currentItems[items[i].priority-currentStart] = items[i].item;
+			used[items[i].priority-currentStart] = true;
 		}
 	}
-#ifndef NDEBUG
-	std::get<3>(ret)[textLen-1] = true;
-#endif
-	LMSLeft.insert(textLen-1, std::get<1>(ret)[nextSymbol]+indicesWritten[nextSymbol]);
-	IndexType lastIndex = textLen-1;
-	LMSIndicesOut.write((char*)&lastIndex, sizeof(IndexType));
-	assert(std::get<2>(ret) < textLen/2);
-	std::get<2>(ret)++;
-
-	assert(maxAlphabet+1 < std::numeric_limits<int>::max());
-	while (!LMSLeft.empty())
+	//reads the blocks the window has at this point into a second buffer in the background
+	//blocks appended to the window after this are read when the window is loaded
+	void startReadAhead(size_t fileN)
 	{
-		IndexType index = LMSLeft.get();
-		LMSLeftOut.write((char*)&index, sizeof(IndexType));
-	}
+		assert(readAhead.size() == 0);
+		if (fileN >= pending.size())
+		{
+			return;
+		}
+		readAheadWindow = fileN;
+		readAheadBlocks.clear();
+		spill.flush();
+		size_t totalBytes = 0;
+		for (size_t i = 0; i < spill.numBlocks(fileN); i++)
+		{
+			SpillFile::Block block = spill.block(fileN, i);
+			if (totalBytes+block.bytes > maxReadAheadBytes)
+			{
+				break;
+			}
+			readAheadBlocks.push_back(block);
+			totalBytes += block.bytes;
+		}
+		if (readAheadBlocks.size() == 0)
+		{
+			return;
+		}
+		readAheadData.resize(totalBytes);
+		//one reader per stripe so the stripes' disks are read in parallel
+		for (size_t stripe = 0; stripe < spill.numStripes(); stripe++)
+		{
+			char* dest = readAheadData.data();
+			const SpillFile* file = &spill;
+			std::vector<SpillFile::Block> blocks = readAheadBlocks;
+			readAhead.push_back(std::async(std::launch::async, [file, dest, blocks, stripe]()
+			{
+				size_t pos = 0;
+				for (size_t i = 0; i < blocks.size(); i++)
+				{
+					if (blocks[i].stripe == stripe)
+					{
+						file->readBlock(blocks[i], dest+pos);
+					}
+					pos += blocks[i].bytes;
+				}
+			}));
+		}
+	}
+	//the partially filled block is still in memory, the full ones are read back from the spill file
+	void loadWindow(size_t fileN)
+	{
+		size_t firstBlock = 0;
+		if (readAheadWindow == fileN)
+		{
+			for (size_t i = 0; i < readAhead.size(); i++)
+			{
+				readAhead[i].get();
+			}
+			readAhead.clear();
+			size_t pos = 0;
+			for (size_t i = 0; i < readAheadBlocks.size(); i++)
+			{
+				placeBlock(readAheadData.data()+pos, readAheadBlocks[i].bytes);
+				pos += readAheadBlocks[i].bytes;
+			}
+			firstBlock = readAheadBlocks.size();
+			readAheadBlocks.clear();
+			readAheadWindow = 0;
+		}
+		unlinkPending(fileN);
+		std::vector<WriteType> block;
+		block.swap(pending[fileN]);
+		pendingCapacity -= block.capacity();
+		placeItems(block.data(), block.size());
+		freeMemory(block);
+		spill.flush();
+		for (size_t i = firstBlock; i < spill.numBlocks(fileN); i++)
+		{
+			SpillFile::Block info = spill.block(fileN, i);
+			encoded.resize(info.bytes);
+			spill.readBlock(info, encoded.data());
+			placeBlock(encoded.data(), info.bytes);
+		}
+		spill.forgetWindow(fileN);
+	}
+	Layout sizes;
+	size_t numItems;
+	size_t k;
+	size_t currentStart;
+	size_t currentPos;
+	size_t currentEnd;
+	size_t maxPriority;
+	size_t blockLength;
+	std::vector<ItemType> currentItems;
+	std::vector<bool> used;
+	std::vector<std::vector<WriteType>> pending;
+	std::vector<size_t> pendingOfSize;
+	std::vector<size_t> pendingNext;
+	std::vector<size_t> pendingPrevious;
+	size_t largestPending;
+	size_t pendingCapacity;
+	SpillFile spill;
+	std::vector<char> encoded;
+	size_t maxReadAheadBytes;
+	size_t readAheadWindow;
+	std::vector<SpillFile::Block> readAheadBlocks;
+	std::vector<char> readAheadData;
+	std::vector<std::future<void>> readAhead;
+};
+
+//the text has storedLen symbols followed by sentinels, so the sentinel of the in-files BWT doesn't have to be stored
+template <class Alphabet>
+inline Alphabet symbolOrSentinel(const Alphabet* const text, size_t storedLen, size_t index)
+{
+	return index < storedLen ? text[index] : 0;
+}
+
+//kernels for the byte alphabet, using AVX2 or SSE2 depending on what the CPU supports with a scalar fallback
+//adds the counts of every byte of text to counts, which has 256 entries
+void byteHistogram(const unsigned char* text, size_t textLen, size_t* counts);
+//bit j of less[w] is set if text[64w+j] < text[64w+j+1], and of greater[w] if it's bigger, text must have words*64+1 readable bytes
+void compareNeighbourWords(const unsigned char* text, size_t words, uint64_t* less, uint64_t* greater);
+//the index of the first byte where first and second differ, or bytes if they are equal
+size_t firstMismatchBytes(const unsigned char* first, const unsigned char* second, size_t bytes);
+
+//symbols are equal when their bytes are, so the byte kernel works for every alphabet
+template <class Alphabet>
+size_t firstMismatch(const Alphabet* first, const Alphabet* second, size_t count)
+{
+	return firstMismatchBytes((const unsigned char*)first, (const unsigned char*)second, count*sizeof(Alphabet))/sizeof(Alphabet);
+}
+
+template <class Alphabet>
+void compareNeighbourWords(const Alphabet* text, size_t words, uint64_t* less, uint64_t* greater)
+{
+	for (size_t w = 0; w < words; w++)
+	{
+		uint64_t lessBits = 0;
+		uint64_t greaterBits = 0;
+		for (size_t j = 0; j < 64; j++)
+		{
+			lessBits |= (uint64_t)(text[64*w+j] < text[64*w+j+1]) << j;
+			greaterBits |= (uint64_t)(text[64*w+j] > text[64*w+j+1]) << j;
+		}
+		less[w] = lessBits;
+		greater[w] = greaterBits;
+	}
+}
+
+//the neighbour comparisons of the count indices starting from start, 64 per word, bits past count are zero
+//the text has storedLen symbols followed by sentinels
+template <class Alphabet>
+void compareNeighbours(const Alphabet* const text, size_t storedLen, size_t start, size_t count, uint64_t* less, uint64_t* greater)
+{
+	size_t fullWords = 0;
+	if (storedLen > start)
+	{
+		fullWords = std::min(count/64, (storedLen-start-1)/64);
+	}
+	compareNeighbourWords(text+start, fullWords, less, greater);
+	for (size_t w = fullWords; w < (count+63)/64; w++)
+	{
+		less[w] = 0;
+		greater[w] = 0;
+		for (size_t j = 0; j < 64 && 64*w+j < count; j++)
+		{
+			Alphabet current = symbolOrSentinel(text, storedLen, start+64*w+j);
+			Alphabet next = symbolOrSentinel(text, storedLen, start+64*w+j+1);
+			less[w] |= (uint64_t)(current < next) << j;
+			greater[w] |= (uint64_t)(current > next) << j;
+		}
+	}
+}
+
+//counts into four interleaved tables when the alphabet is small, so runs of the same symbol don't wait on one counter
+template <class Alphabet>
+std::vector<size_t> countSymbols(const Alphabet* text, size_t textLen, size_t maxAlphabet)
+{
+	std::vector<size_t> sums(maxAlphabet+1, 0);
+	size_t i = 0;
+	if (maxAlphabet < 256)
+	{
+		std::vector<size_t> tables(4*(maxAlphabet+1), 0);
+		size_t* table0 = tables.data();
+		size_t* table1 = table0+maxAlphabet+1;
+		size_t* table2 = table1+maxAlphabet+1;
+		size_t* table3 = table2+maxAlphabet+1;
+		for (; i+4 <= textLen; i += 4)
+		{
+			assert(text[i] <= maxAlphabet && text[i+1] <= maxAlphabet && text[i+2] <= maxAlphabet && text[i+3] <= maxAlphabet);
+			table0[text[i]]++;
+			table1[text[i+1]]++;
+			table2[text[i+2]]++;
+			table3[text[i+3]]++;
+		}
+		for (size_t a = 0; a < maxAlphabet+1; a++)
+		{
+			sums[a] = table0[a]+table1[a]+table2[a]+table3[a];
+		}
+	}
+	for (; i < textLen; i++)
+	{
+		assert(text[i] <= maxAlphabet);
+		sums[text[i]]++;
+	}
+	return sums;
+}
+
+inline std::vector<size_t> countSymbols(const unsigned char* text, size_t textLen, size_t maxAlphabet)
+{
+	std::vector<size_t> counts(256, 0);
+	byteHistogram(text, textLen, counts.data());
+	for (size_t i = maxAlphabet+1; i < 256; i++)
+	{
+		assert(counts[i] == 0);
+	}
+	counts.resize(maxAlphabet+1);
+	return counts;
+}
+
+template <class Alphabet>
+std::vector<size_t> charSums(const Alphabet* text, size_t textLen, size_t maxAlphabet)
+{
+	std::vector<size_t> sums = countSymbols(text, textLen, maxAlphabet);
+	std::vector<size_t> ret(maxAlphabet+2, 0);
+	for (size_t i = 1; i < maxAlphabet+2; i++)
+	{
+		ret[i] = ret[i-1]+sums[i-1];
+	}
+	return ret;
+}
+
+//the L/S type of every suffix packed into bits, n/8 bytes, so the induction steps don't have to compare neighbouring symbols
+class SuffixTypes
+{
+public:
+	SuffixTypes() : bits(), length(0) {};
+	explicit SuffixTypes(size_t length) : bits((length+63)/64, 0), length(length) {};
+	static size_t bytesFor(size_t length) { return (length+63)/64*sizeof(uint64_t); };
+	size_t size() const { return length; };
+	bool isSType(size_t index) const
+	{
+		assert(index < length);
+		return (bits[index/64] >> (index%64)) & 1;
+	};
+	//for prefetching
+	const uint64_t* wordOf(size_t index) const
+	{
+		return bits.data()+index/64;
+	};
+	//the LMS-type suffixes are where the LMS substrings start, the first suffix is never one
+	bool isLMSType(size_t index) const
+	{
+		return index > 0 && isSType(index) && !isSType(index-1);
+	};
+	//the first LMS-type index after index or size() if there is none, found a word at a time
+	size_t nextLMSType(size_t index) const
+	{
+		for (size_t word = (index+1)/64; word < bits.size(); word++)
+		{
+			uint64_t previousSType = (bits[word] << 1) | (word > 0 ? bits[word-1] >> 63 : 0);
+			uint64_t LMSType = bits[word] & ~previousSType;
+			if (word == (index+1)/64)
+			{
+				LMSType &= ~(uint64_t)0 << ((index+1)%64);
+			}
+			if (LMSType != 0)
+			{
+				return word*64+__builtin_ctzll(LMSType);
+			}
+		}
+		return length;
+	};
+	//marks [start, end) as S-type, different threads may mark different words at the same time
+	void setSType(size_t start, size_t end)
+	{
+		assert(start <= end && end <= length);
+		while (start < end)
+		{
+			size_t wordEnd = std::min(end, (start/64+1)*64);
+			uint64_t mask = (wordEnd-start == 64) ? ~(uint64_t)0 : (((uint64_t)1 << (wordEnd-start))-1) << (start%64);
+			bits[start/64] |= mask;
+			start = wordEnd;
+		}
+	};
+private:
+	std::vector<uint64_t> bits;
+	size_t length;
+};
+
+//classifies the indices in [start, end) like the paper's step 1, the type of index end is given
+//adds the L-type indices of every symbol to Lcount and calls foundLMS for the LMS-type indices in text order
+//an LMS-type index at start whose run of equal symbols begins in the previous chunk is found by the previous chunk
+//the S-type indices are marked in types unless it is null
+template <class Alphabet, class IndexType, class LMSFunction>
+void classifyChunk(const Alphabet* const text, size_t storedLen, size_t start, size_t end, bool endIsSType, IndexType* Lcount, LMSFunction foundLMS, SuffixTypes* types)
+{
+	size_t lastCharacterBoundary = start;
+	bool lastWasLType = false;
+	if (start > 0)
+	{
+		lastWasLType = symbolOrSentinel(text, storedLen, start-1) > symbolOrSentinel(text, storedLen, start);
+	}
+	//only the indices where the next symbol differs matter, they are found from comparison bitmasks
+	const size_t batchWords = 64;
+	uint64_t less[batchWords];
+	uint64_t greater[batchWords];
+	for (size_t batchStart = start; batchStart < end; batchStart += batchWords*64)
+	{
+		size_t count = std::min(end-batchStart, batchWords*64);
+		compareNeighbours(text, storedLen, batchStart, count, less, greater);
+		for (size_t w = 0; w < (count+63)/64; w++)
+		{
+			uint64_t unequal = less[w] | greater[w];
+			while (unequal != 0)
+			{
+				size_t bit = __builtin_ctzll(unequal);
+				unequal &= unequal-1;
+				size_t i = batchStart+64*w+bit;
+				assert(i < storedLen);
+				if ((greater[w] >> bit) & 1)
+				{
+					//L-type, and all in [lastCharacterBoundary, i] are L-type of the same letter
+					Lcount[text[i]] += (i-lastCharacterBoundary)+1;
+					lastWasLType = true;
+				}
+				else
+				{
+					//S-type, and all in [lastCharacterBoundary, i] are S-type of the same letter
+					if (lastWasLType)
+					{
+						foundLMS((IndexType)lastCharacterBoundary);
+					}
+					if (types != nullptr)
+					{
+						types->setSType(lastCharacterBoundary, i+1);
+					}
+					lastWasLType = false;
+				}
+				lastCharacterBoundary = i+1;
+			}
+		}
+	}
+	//the last run continues past the chunk and has the type of index end
+	if (lastCharacterBoundary < end)
+	{
+		if (!endIsSType)
+		{
+			Lcount[symbolOrSentinel(text, storedLen, end)] += end-lastCharacterBoundary;
+		}
+		else
+		{
+			if (lastWasLType)
+			{
+				foundLMS((IndexType)lastCharacterBoundary);
+			}
+			if (types != nullptr)
+			{
+				types->setSType(lastCharacterBoundary, end);
+			}
+		}
+	}
+}
+
+//L/S classification of the indices [0, textLen-1), index textLen-1 is the sentinel which is S-type
+//adds the L-type indices of every symbol to Lcount and calls foundLMS for the LMS-type indices in text order
+//the text is split into chunks which are classified in parallel, at most bufferBytes is used for the chunks' results at a time
+//the type of a chunk's last run depends only on the first unequal pair of symbols after it, which is found before classifying
+//the types of all indices are stored in types unless it is null
+template <class Alphabet, class IndexType, class LMSFunction>
+void classifySuffixTypes(const Alphabet* const text, size_t storedLen, size_t textLen, size_t maxAlphabet, size_t bufferBytes, std::vector<IndexType>& Lcount, LMSFunction foundLMS, SuffixTypes* types)
+{
+	if (types != nullptr)
+	{
+		assert(types->size() == textLen);
+		types->setSType(textLen-1, textLen);
+	}
+	assert(Lcount.size() == maxAlphabet+1);
+	const size_t minChunkLen = (size_t)1 << 16;
+	size_t threads = getNumThreads();
+	size_t tableBytes = (maxAlphabet+1)*sizeof(IndexType);
+	size_t chunkLen = 0;
+	if (threads > 1 && bufferBytes/threads > tableBytes)
+	{
+		//a chunk has at most one LMS-type index per two indices
+		chunkLen = (bufferBytes/threads-tableBytes)/sizeof(IndexType)*2;
+		chunkLen = std::min(chunkLen, (textLen-1+threads-1)/threads);
+		//chunks don't share words of the types
+		chunkLen = chunkLen/64*64;
+	}
+	//with big alphabets merging the chunks' L-counts would cost more than the classification
+	if (chunkLen < minChunkLen || chunkLen < 16*(maxAlphabet+1))
+	{
+		classifyChunk(text, storedLen, 0, textLen-1, true, Lcount.data(), foundLMS, types);
+		return;
+	}
+	size_t numChunks = (textLen-1+chunkLen-1)/chunkLen;
+	enum StartType { L_TYPE, S_TYPE, NEXT_CHUNKS_TYPE };
+	std::vector<char> startType(numChunks+1, S_TYPE);
+	parallelFor(numChunks, [&](size_t chunk)
+	{
+		size_t end = std::min((chunk+1)*chunkLen, textLen-1);
+		size_t i = chunk*chunkLen;
+		while (i < end && symbolOrSentinel(text, storedLen, i) == symbolOrSentinel(text, storedLen, i+1))
+		{
+			i++;
+		}
+		if (i == end)
+		{
+			startType[chunk] = NEXT_CHUNKS_TYPE;
+		}
+		else
+		{
+			startType[chunk] = symbolOrSentinel(text, storedLen, i) < symbolOrSentinel(text, storedLen, i+1) ? S_TYPE : L_TYPE;
+		}
+	});
+	for (size_t chunk = numChunks; chunk > 0; chunk--)
+	{
+		if (startType[chunk-1] == NEXT_CHUNKS_TYPE)
+		{
+			startType[chunk-1] = startType[chunk];
+		}
+	}
+	std::vector<std::vector<IndexType>> Lcounts(threads, std::vector<IndexType>(maxAlphabet+1, 0));
+	std::vector<std::vector<IndexType>> LMS(threads);
+	for (size_t firstChunk = 0; firstChunk < numChunks; firstChunk += threads)
+	{
+		size_t roundChunks = std::min(threads, numChunks-firstChunk);
+		parallelFor(roundChunks, [&](size_t i)
+		{
+			size_t chunk = firstChunk+i;
+			size_t end = std::min((chunk+1)*chunkLen, textLen-1);
+			std::vector<IndexType>& found = LMS[i];
+			found.clear();
+			classifyChunk(text, storedLen, chunk*chunkLen, end, startType[chunk+1] == S_TYPE, Lcounts[i].data(), [&found](IndexType index) { found.push_back(index); }, types);
+		});
+		for (size_t i = 0; i < roundChunks; i++)
+		{
+			for (size_t a = 0; a < maxAlphabet+1; a++)
+			{
+				Lcount[a] += Lcounts[i][a];
+				Lcounts[i][a] = 0;
+			}
+			for (size_t j = 0; j < LMS[i].size(); j++)
+			{
+				foundLMS(LMS[i][j]);
+			}
+		}
+	}
+}
+
+template <class Alphabet>
+SuffixTypes computeSuffixTypes(const Alphabet* const text, size_t textLen, size_t maxAlphabet, size_t bufferBytes)
+{
+	SuffixTypes types(textLen);
+	std::vector<size_t> Lcount(maxAlphabet+1, 0);
+	classifySuffixTypes(text, textLen, textLen, maxAlphabet, bufferBytes, Lcount, [](size_t) {}, &types);
+	return types;
+}
+
+#ifndef NDEBUG
+template <class Alphabet>
+std::vector<bool> suffixIsSType(const Alphabet* const text, size_t storedLen, size_t textLen)
+{
+	std::vector<bool> ret(textLen, false);
+	ret[textLen-1] = true;
+	for (size_t i = textLen-1; i > 0; i--)
+	{
+		Alphabet current = symbolOrSentinel(text, storedLen, i-1);
+		Alphabet next = symbolOrSentinel(text, storedLen, i);
+		ret[i-1] = current < next || (current == next && ret[i]);
+	}
+	return ret;
+}
+#endif
+
+//returns random access written results in the tuple, and sequential access written results with streams
+template <class Alphabet, class IndexType>
+std::tuple<std::vector<IndexType>, //L-counts
+           size_t               //count of LMS-type indices
+#ifndef NDEBUG
+           ,std::vector<bool> //is S-type
+#endif
+           > 
+preprocess(const Alphabet* const text, size_t textLen, size_t maxAlphabet, std::ostream& LMSLeftOut, std::ostream& charSumOut, std::ostream& LMSIndicesOut, bool addSentinel, SuffixTypes* types)
+{
+	std::tuple<std::vector<IndexType>, 
+	           size_t
+#ifndef NDEBUG
+	           ,std::vector<bool>
+#endif
+	           > ret;
+	std::get<0>(ret).resize(maxAlphabet+1, 0);
+	std::get<1>(ret) = 0;
+	size_t storedLen = addSentinel ? textLen-1 : textLen;
+#ifndef NDEBUG
+	std::get<2>(ret) = suffixIsSType(text, storedLen, textLen);
+#endif
+	std::vector<size_t> sums = countSymbols(text, storedLen, maxAlphabet);
+	if (addSentinel)
+	{
+		sums[0]++;
+	}
+	std::vector<std::vector<IndexType>> buckets(maxAlphabet+1);
+	//everything is in memory anyway, so the chunks may use as much memory as they want
+	classifySuffixTypes(text, storedLen, textLen, maxAlphabet, std::numeric_limits<size_t>::max(), std::get<0>(ret), [&](IndexType index)
+	{
+		assert(index < storedLen);
+		buckets[text[index]].push_back(index);
+		LMSIndicesOut.write((char*)&index, sizeof(IndexType));
+		assert(std::get<1>(ret) < textLen/2);
+		std::get<1>(ret)++;
+	}, types);
+	for (size_t i = 0; i < maxAlphabet+1; i++)
+	{
+		assert(std::get<0>(ret)[i] <= sums[i]);
+	}
+	Alphabet lastSymbol = symbolOrSentinel(text, storedLen, textLen-1);
+	buckets[lastSymbol].push_back(textLen-1);
+	IndexType lastIndex = textLen-1;
+	LMSIndicesOut.write((char*)&lastIndex, sizeof(IndexType));
+	assert(std::get<1>(ret) < textLen/2);
+	std::get<1>(ret)++;
+
+	assert(maxAlphabet+1 < std::numeric_limits<int>::max());
+	IndexType charSumSum = 0;
+	charSumOut.write((char*)&charSumSum, sizeof(IndexType));
+	for (int i = 0; i < maxAlphabet+1; i++)
+	{
+		charSumSum = charSumSum+sums[i];
+		charSumOut.write((char*)&charSumSum, sizeof(IndexType));
+		LMSLeftOut.write((char*)buckets[i].data(), buckets[i].size()*sizeof(IndexType));
+		freeMemory(buckets[i]);
+	}
+
+	return ret;
+}
+
+template <class Alphabet, class IndexType>
+std::tuple<std::vector<IndexType>, //L-counts
+           std::vector<IndexType>, //charSum
+           size_t               //count of LMS-type indices
+#ifndef NDEBUG
+           ,std::vector<bool> //is S-type
+#endif
+           > 
+preprocessLowMemory(const Alphabet* const text, size_t textLen, size_t maxAlphabet, size_t k, std::ostream& LMSLeftOut, std::ostream& LMSIndicesOut, bool addSentinel, SuffixTypes* types)
+{
+	std::tuple<std::vector<IndexType>, 
+	           std::vector<IndexType>,
+	           size_t
+#ifndef NDEBUG
+	           ,std::vector<bool>
+#endif
+	           > ret;
+	std::get<0>(ret).resize(maxAlphabet+1, 0);
+	std::get<1>(ret).resize(maxAlphabet+2, 0);
+	std::get<2>(ret) = 0;
+	//with addSentinel the text has only textLen-1 symbols and the sentinel is implicit
+	size_t storedLen = addSentinel ? textLen-1 : textLen;
+	//symbol counts are needed first for calculating where each LMS index would go in the LMSleft array
+	std::vector<size_t> sums = countSymbols(text, storedLen, maxAlphabet);
+	if (addSentinel)
+	{
+		sums[0]++;
+	}
+	for (size_t i = 1; i < maxAlphabet+2; i++)
+	{
+		std::get<1>(ret)[i] = std::get<1>(ret)[i-1]+sums[i-1];
+	}
+	freeMemory(sums);
+	//with several threads a quarter of the memory goes to the chunks classified in parallel
+	size_t chunkBytes = getNumThreads() > 1 ? k/4 : 0;
+	WeirdPriorityQueue<IndexType, IndexType> LMSLeft(textLen, k-chunkBytes);
+	std::vector<IndexType> indicesWritten(maxAlphabet+1, 0);
+	classifySuffixTypes(text, storedLen, textLen, maxAlphabet, chunkBytes, std::get<0>(ret), [&](IndexType index)
+	{
+		assert(index < storedLen);
+		Alphabet symbol = text[index];
+		LMSLeft.insert(index, std::get<1>(ret)[symbol]+indicesWritten[symbol]);
+		indicesWritten[symbol]++;
+		LMSIndicesOut.write((char*)&index, sizeof(IndexType));
+		assert(std::get<2>(ret) < textLen/2);
+		std::get<2>(ret)++;
+	}, types);
+#ifndef NDEBUG
+	std::get<3>(ret) = suffixIsSType(text, storedLen, textLen);
+#endif
+	Alphabet lastSymbol = symbolOrSentinel(text, storedLen, textLen-1);
+	LMSLeft.insert(textLen-1, std::get<1>(ret)[lastSymbol]+indicesWritten[lastSymbol]);
+	IndexType lastIndex = textLen-1;
+	LMSIndicesOut.write((char*)&lastIndex, sizeof(IndexType));
+	assert(std::get<2>(ret) < textLen/2);
+	std::get<2>(ret)++;
+
+	assert(maxAlphabet+1 < std::numeric_limits<int>::max());
+	while (!LMSLeft.empty())
+	{
+		IndexType index = LMSLeft.get();
+		LMSLeftOut.write((char*)&index, sizeof(IndexType));
+	}
 
 	return ret;
 }
 
+//calls work(start, end) for count items split evenly over the threads, or once for all of them if there are less than minParallelCount
+template <class Work>
+void forPieces(size_t count, size_t minParallelCount, Work work)
+{
+	size_t threads = getNumThreads();
+	if (threads == 1 || count < minParallelCount)
+	{
+		work(0, count);
+		return;
+	}
+	size_t pieceLen = (count+threads-1)/threads;
+	parallelFor(threads, [&](size_t piece)
+	{
+		work(std::min(count, piece*pieceLen), std::min(count, (piece+1)*pieceLen));
+	});
+}
+
+//the suffix preceding a scanned suffix, and whether the scan induces it
+template <class Alphabet, class IndexType>
+struct PrecedingSuffix
+{
+	IndexType index;
+	Alphabet symbol;
+	//the symbol before the preceding suffix, which is its BWT symbol in steps 7 and 8
+	Alphabet bwtSymbol;
+	bool induce;
+};
+
+//the induction scans work on blocks of the scanned bucket, the random reads of the text and types for a block
+//are done first, in parallel for big blocks, and then the block is placed into the buckets in order
+const size_t inductionBlock = (size_t)1 << 16;
+const size_t minParallelInductionBlock = (size_t)1 << 12;
+
+//the lookups prefetch the text and types this many suffixes ahead, compiling with -DPREFETCH_DISTANCE=n changes it and 0 turns prefetching off
+#ifndef PREFETCH_DISTANCE
+#define PREFETCH_DISTANCE 32
+#endif
+
+template <class Alphabet, class IndexType>
+void lookUpPreceding(const Alphabet* const text, size_t textLen, const SuffixTypes& types, bool induceSType, const IndexType* scanned, size_t count, PrecedingSuffix<Alphabet, IndexType>* preceding)
+{
+	auto lookUp = [&](size_t start, size_t end)
+	{
+		for (size_t i = start; i < end; i++)
+		{
+#if PREFETCH_DISTANCE > 0
+			if (i+PREFETCH_DISTANCE < end)
+			{
+				//text[j-2], text[j-1] and the type of j-1 are usually in these two lines
+				IndexType ahead = scanned[i+PREFETCH_DISTANCE];
+				IndexType aheadMinus1 = ahead == 0 ? textLen-1 : ahead-1;
+				__builtin_prefetch(text+aheadMinus1);
+				__builtin_prefetch(types.wordOf(aheadMinus1));
+			}
+#endif
+			IndexType j = scanned[i];
+			assert(j < textLen);
+			IndexType jminus1 = j == 0 ? textLen-1 : j-1;
+			IndexType writeIndex = jminus1 == 0 ? textLen-1 : jminus1-1;
+			preceding[i].index = jminus1;
+			preceding[i].symbol = text[jminus1];
+			preceding[i].bwtSymbol = text[writeIndex];
+			preceding[i].induce = types.isSType(jminus1) == induceSType;
+		}
+	};
+	forPieces(count, minParallelInductionBlock, lookUp);
+}
+
 //high memory alternative used for in-memory BWT
 //sorts (with step 3) the LMS-type substrings
 template <class Alphabet, class IndexType, bool isStep7>
-void step2or7(const Alphabet* const text, size_t textLen, size_t maxAlphabet, std::ostream& out, std::istream& LMSLeft, size_t LMSLeftSize, Alphabet* const result, const std::vector<IndexType>& charSum, const std::vector<IndexType>& Lsum)
+void step2or7(const Alphabet* const text, size_t textLen, size_t maxAlphabet, std::ostream& out, std::istream& LMSLeft, size_t LMSLeftSize, Alphabet* const result, const std::vector<IndexType>& charSum, const std::vector<IndexType>& Lsum, const SuffixTypes& types)
 {
 	if (isStep7)
 	{
@@ -492,52 +1442,133 @@ void step2or7(const Alphabet* const text, size_t textLen, size_t maxAlphabet, st
 	{
 		buckets[i].reserve(buckets[i].size()+Lsum[i]);
 	}
+	std::vector<PrecedingSuffix<Alphabet, IndexType>> preceding(std::min(inductionBlock, textLen));
 	for (int bucket = 0; bucket < maxAlphabet+1; bucket++)
 	{
 		//can't use iterators because indices may be pushed into current bucket, and that can invalidate iterators
-		for (size_t i = 0; i < buckets[bucket].size(); i++)
+		//the indices pushed into the current bucket while placing a block are after the block, so they are in a later block
+		size_t count;
+		for (size_t blockStart = 0; blockStart < buckets[bucket].size(); blockStart += count)
 		{
-			IndexType j = buckets[bucket][i];
-			IndexType jminus1 = j-1;
-			if (j == 0)
-			{
-				jminus1 = textLen-1;
-			}
-			assert(j <= textLen);
-			if (text[jminus1] >= text[j])
+			count = std::min(buckets[bucket].size()-blockStart, preceding.size());
+			lookUpPreceding(text, textLen, types, false, buckets[bucket].data()+blockStart, count, preceding.data());
+			for (size_t i = 0; i < count; i++)
 			{
-				assert(text[jminus1] < maxAlphabet+1);
-				buckets[text[jminus1]].push_back(jminus1);
-				if (isStep7)
+				IndexType j = buckets[bucket][blockStart+i];
+				const PrecedingSuffix<Alphabet, IndexType>& before = preceding[i];
+				assert(before.induce == (text[before.index] >= text[j]));
+				if (before.induce)
 				{
-					IndexType writeIndex = jminus1-1;
-					if (jminus1 == 0)
+					assert(before.symbol < maxAlphabet+1);
+					buckets[before.symbol].push_back(before.index);
+					if (isStep7)
 					{
-						writeIndex = textLen-1;
+						assert(charSum[before.symbol]+numbersOutputted[before.symbol] < textLen);
+						assert(numbersOutputted[before.symbol] < charSum[before.symbol+1]-charSum[before.symbol]);
+						result[charSum[before.symbol]+numbersOutputted[before.symbol]] = before.bwtSymbol;
+						numbersOutputted[before.symbol]++;
 					}
-					assert(charSum[text[jminus1]]+numbersOutputted[text[jminus1]] < textLen);
-					assert(numbersOutputted[text[jminus1]] < charSum[text[jminus1]+1]-charSum[text[jminus1]]);
-					result[charSum[text[jminus1]]+numbersOutputted[text[jminus1]]] = text[writeIndex];
-					numbersOutputted[text[jminus1]]++;
 				}
-			}
-			else
-			{
-				out.write((char*)&j, sizeof(IndexType));
+				else
+				{
+					out.write((char*)&j, sizeof(IndexType));
+				}
 			}
 		}
 		freeMemory(buckets[bucket]);
 	}
 }
 
+//writes the BWT symbols of steps 7 and 8 into the output file through a buffer per bucket
+//step 7 places the L-type suffixes of a bucket from its start upwards and step 8 the S-type ones from its end downwards,
+//so every bucket is filled through one cursor and a full buffer is one contiguous write
+template <class Alphabet, class IndexType>
+class BucketWriter
+{
+public:
+	BucketWriter(OutputFile& file, const std::vector<IndexType>& charSum, size_t maxAlphabet, bool downwards, size_t maxBytes) :
+		file(file),
+		downwards(downwards),
+		next(maxAlphabet+1),
+		buffered(maxAlphabet+1, 0),
+		buffers(maxAlphabet+1)
+	{
+		size_t usedBuckets = 0;
+		for (size_t i = 0; i < maxAlphabet+1; i++)
+		{
+			usedBuckets += charSum[i+1] > charSum[i];
+		}
+		size_t bufferLen = std::max((size_t)64, maxBytes/std::max(usedBuckets, (size_t)1)/sizeof(Alphabet));
+		for (size_t i = 0; i < maxAlphabet+1; i++)
+		{
+			next[i] = downwards ? (size_t)charSum[i+1]-1 : (size_t)charSum[i];
+			buffers[i].resize(std::min(bufferLen, (size_t)(charSum[i+1]-charSum[i])));
+		}
+	};
+	BucketWriter(const BucketWriter& second) = delete;
+	BucketWriter& operator=(const BucketWriter& second) = delete;
+	void put(size_t bucket, size_t pos, Alphabet symbol)
+	{
+		assert(pos == next[bucket]);
+		std::vector<Alphabet>& buffer = buffers[bucket];
+		assert(buffered[bucket] < buffer.size());
+		if (downwards)
+		{
+			buffer[buffer.size()-1-buffered[bucket]] = symbol;
+			next[bucket]--;
+		}
+		else
+		{
+			buffer[buffered[bucket]] = symbol;
+			next[bucket]++;
+		}
+		buffered[bucket]++;
+		if (buffered[bucket] == buffer.size())
+		{
+			flush(bucket);
+		}
+	};
+	void flush()
+	{
+		for (size_t i = 0; i < buffers.size(); i++)
+		{
+			flush(i);
+		}
+	};
+private:
+	void flush(size_t bucket)
+	{
+		size_t count = buffered[bucket];
+		if (count == 0)
+		{
+			return;
+		}
+		const Alphabet* data = buffers[bucket].data();
+		size_t start = next[bucket]-count;
+		if (downwards)
+		{
+			data += buffers[bucket].size()-count;
+			start = next[bucket]+1;
+		}
+		file.write((const char*)data, count*sizeof(Alphabet), start*sizeof(Alphabet));
+		buffered[bucket] = 0;
+	};
+	OutputFile& file;
+	bool downwards;
+	std::vector<size_t> next;
+	std::vector<size_t> buffered;
+	std::vector<std::vector<Alphabet>> buffers;
+};
+
 //low memory alternative used for in-file BWT
 //sorts (with step 3) the LMS-type substrings
+//without types the type of j-1 is found by comparing with text[j], which works because j is either L-type or LMS-type
 template <class Alphabet, class IndexType, bool isStep7>
-void step2or7LowMemory(const Alphabet* const text, size_t textLen, size_t maxAlphabet, size_t k, std::ostream& out, std::istream& LMSLeft, size_t LMSLeftSize, WeirdPriorityQueue<Alphabet, IndexType>* result, const std::vector<IndexType>& charSum, const std::vector<IndexType>& Lsum)
+void step2or7LowMemory(const Alphabet* const text, size_t textLen, size_t maxAlphabet, size_t k, std::ostream& out, std::istream& LMSLeft, size_t LMSLeftSize, BucketWriter<Alphabet, IndexType>* const result, WeirdPriorityQueue<IndexType, IndexType>* const ranks, const std::vector<IndexType>& charSum, const std::vector<IndexType>& Lsum, const SuffixTypes* types)
 {
 	if (isStep7)
 	{
-		assert(result != nullptr);
+		assert((result != nullptr) != (ranks != nullptr));
 	}
 	std::vector<IndexType> numbersArrayed(maxAlphabet+1, 0);
 	WeirdPriorityQueue<IndexType, IndexType> priorities(textLen, k);
@@ -564,19 +1595,25 @@ void step2or7LowMemory(const Alphabet* const text, size_t textLen, size_t maxAlp
 		assert(j < textLen);
 		assert(text[jminus1] <= maxAlphabet);
 		assert(text[j] <= maxAlphabet);
-		if (text[jminus1] >= text[j])
+		bool jminus1IsLType = types != nullptr ? !types->isSType(jminus1) : text[jminus1] >= text[j];
+		assert(jminus1IsLType == (text[jminus1] >= text[j]));
+		if (jminus1IsLType)
 		{
 			IndexType pos = charSum[text[jminus1]]+numbersArrayed[text[jminus1]];
 			priorities.insert(jminus1, pos);
 			numbersArrayed[text[jminus1]]++;
-			if (isStep7)
+			if (isStep7 && ranks != nullptr)
+			{
+				ranks->insert(pos, jminus1);
+			}
+			else if (isStep7)
 			{
 				IndexType writeIndex = jminus1-1;
 				if (jminus1 == 0)
 				{
 					writeIndex = textLen-1;
 				}
-				result->insert(text[writeIndex], pos);
+				result->put(text[jminus1], pos, text[writeIndex]);
 			}
 		}
 		else
@@ -589,7 +1626,7 @@ void step2or7LowMemory(const Alphabet* const text, size_t textLen, size_t maxAlp
 //high memory alternative for in-memory BWT
 //sorts (with step 2) the LMS-type substrings
 template <class Alphabet, class IndexType, bool isStep8>
-void step3or8(const Alphabet* const text, size_t textLen, size_t maxAlphabet, std::ostream& out, std::istream& LMSRight, size_t LMSRightSize, Alphabet* const result, const std::vector<IndexType>& charSum, const std::vector<IndexType>& Lsum)
+void step3or8(const Alphabet* const text, size_t textLen, size_t maxAlphabet, std::ostream& out, std::istream& LMSRight, size_t LMSRightSize, Alphabet* const result, const std::vector<IndexType>& charSum, const std::vector<IndexType>& Lsum, const SuffixTypes& types)
 {
 	if (isStep8)
 	{
@@ -611,44 +1648,42 @@ void step3or8(const Alphabet* const text, size_t textLen, size_t maxAlphabet, st
 		std::reverse(buckets[i].begin(), buckets[i].end());
 		buckets[i].reserve(buckets[i].size()+(charSum[i+1]-charSum[i]-Lsum[i]));
 	}
+	std::vector<PrecedingSuffix<Alphabet, IndexType>> preceding(std::min(inductionBlock, textLen));
 	for (int bucket = maxAlphabet; bucket >= 0; bucket--)
 	{
 		//can't use iterators because indices may be pushed into current bucket, and that can invalidate iterators
-		for (size_t i = 0; i < buckets[bucket].size(); i++)
+		//the indices pushed into the current bucket while placing a block are after the block, so they are in a later block
+		size_t count;
+		for (size_t blockStart = 0; blockStart < buckets[bucket].size(); blockStart += count)
 		{
-			IndexType j = buckets[bucket][i];
-			IndexType jminus1 = j-1;
-			if (j == 0)
-			{
-				jminus1 = textLen-1;
-			}
-			assert(j <= textLen);
-			assert(text[j] < maxAlphabet+1);
-			if (text[jminus1] <= text[j])
+			count = std::min(buckets[bucket].size()-blockStart, preceding.size());
+			lookUpPreceding(text, textLen, types, true, buckets[bucket].data()+blockStart, count, preceding.data());
+			for (size_t i = 0; i < count; i++)
 			{
-				assert(text[jminus1] < maxAlphabet+1);
-				buckets[text[jminus1]].push_back(jminus1);
-				if (isStep8)
+				IndexType j = buckets[bucket][blockStart+i];
+				const PrecedingSuffix<Alphabet, IndexType>& before = preceding[i];
+				assert(text[j] < maxAlphabet+1);
+				assert(before.induce == (text[before.index] <= text[j]));
+				if (before.induce)
 				{
-					IndexType writeIndex = jminus1-1;
-					if (jminus1 == 0)
+					assert(before.symbol < maxAlphabet+1);
+					buckets[before.symbol].push_back(before.index);
+					if (isStep8)
 					{
-						writeIndex = textLen-1;
+						assert(numbersOutputted[before.symbol] < charSum[before.symbol+1]);
+						assert(numbersOutputted[before.symbol]+charSum[before.symbol] < charSum[before.symbol+1]);
+						assert(charSum[before.symbol+1]-numbersOutputted[before.symbol]-1 < textLen);
+						result[charSum[before.symbol+1]-numbersOutputted[before.symbol]-1] = before.bwtSymbol;
+						numbersOutputted[before.symbol]++;
 					}
-					assert(numbersOutputted[text[jminus1]] < charSum[text[jminus1]+1]);
-					assert(numbersOutputted[text[jminus1]]+1 <= charSum[text[jminus1]+1]);
-					assert(numbersOutputted[text[jminus1]]+charSum[text[jminus1]] < charSum[text[jminus1]+1]);
-					assert(charSum[text[jminus1]+1]-numbersOutputted[text[jminus1]]-1 < textLen);
-					result[charSum[text[jminus1]+1]-numbersOutputted[text[jminus1]]-1] = text[writeIndex];
-					numbersOutputted[text[jminus1]]++;
 				}
-			}
-			else
-			{
-				assert(j != 0);
-				if (!isStep8) //don't return anything for step 8
+				else
 				{
-					out.write((char*)&j, sizeof(IndexType));
+					assert(j != 0);
+					if (!isStep8) //don't return anything for step 8
+					{
+						out.write((char*)&j, sizeof(IndexType));
+					}
 				}
 			}
 		}
@@ -658,12 +1693,13 @@ void step3or8(const Alphabet* const text, size_t textLen, size_t maxAlphabet, st
 
 //low memory alternative for in-file BWT
 //sorts (with step 2) the LMS-type substrings
+//without types the type of j-1 is found by comparing with text[j], which works because j is either S-type or an L-type whose j-1 is S-type
 template <class Alphabet, class IndexType, bool isStep8>
-void step3or8LowMemory(const Alphabet* const text, size_t textLen, size_t maxAlphabet, size_t k, std::ostream& out, std::istream& LMSRight, size_t LMSRightSize, WeirdPriorityQueue<Alphabet, IndexType>* result, const std::vector<IndexType>& charSum, const std::vector<IndexType>& Lsum)
+void step3or8LowMemory(const Alphabet* const text, size_t textLen, size_t maxAlphabet, size_t k, std::ostream& out, std::istream& LMSRight, size_t LMSRightSize, BucketWriter<Alphabet, IndexType>* const result, WeirdPriorityQueue<IndexType, IndexType>* const ranks, const std::vector<IndexType>& charSum, const std::vector<IndexType>& Lsum, const SuffixTypes* types)
 {
 	if (isStep8)
 	{
-		assert(result != nullptr);
+		assert((result != nullptr) != (ranks != nullptr));
 	}
 	//positions start with 0 as the rightmost element because the indices are processed right-to-left
 	WeirdPriorityQueue<IndexType, IndexType> priorities(textLen, k);
@@ -689,21 +1725,27 @@ void step3or8LowMemory(const Alphabet* const text, size_t textLen, size_t maxAlp
 		{
 			jminus1 = textLen-1;
 		}
-		if (text[jminus1] <= text[j])
+		bool jminus1IsSType = types != nullptr ? types->isSType(jminus1) : text[jminus1] <= text[j];
+		assert(jminus1IsSType == (text[jminus1] <= text[j]));
+		if (jminus1IsSType)
 		{
 			IndexType reversePos = charSum[text[jminus1]+1]-numbersArrayed[text[jminus1]]-1;
 			assert(reversePos < textLen);
 			IndexType pos = textLen-reversePos-1; //positions have 0 as rightmost element
 			priorities.insert(jminus1, pos);
 			numbersArrayed[text[jminus1]]++;
-			if (isStep8)
+			if (isStep8 && ranks != nullptr)
+			{
+				ranks->insert(reversePos, jminus1);
+			}
+			else if (isStep8)
 			{
 				IndexType writeIndex = jminus1-1;
 				if (jminus1 == 0)
 				{
 					writeIndex = textLen-1;
 				}
-				result->insert(text[writeIndex], reversePos);
+				result->put(text[jminus1], reversePos, text[writeIndex]);
 			}
 		}
 		else
@@ -750,90 +1792,84 @@ bool LMSSubstringsAreEqual(const Alphabet* text, size_t textLen, size_t str1, si
 	assert(false);
 }
 
-//because this only checks equality, it doesn't need to know whether the suffixes are L-type or S-type
-//Doesn't need information about LMS substring borders to test substring equality. May read values outside the substring, however will not read past the next substring
+//same as above with the borders taken from the suffix types
+//the borders are found from the type bits a word at a time and the symbols are compared with the mismatch kernel
 template <class Alphabet>
-bool LMSSubstringsAreEqualNoBorder(const Alphabet* text, size_t textLen, size_t str1, size_t str2)
+bool LMSSubstringsAreEqual(const Alphabet* text, size_t textLen, size_t str1, size_t str2, const SuffixTypes& types)
 {
+	//also separates the sentinel, which has no border after it, from everything else
 	if (text[str1] != text[str2])
 	{
 		return false;
 	}
-	str1++;
-	str2++;
-	size_t pos = 1;
-	size_t numEquals = 0;
-	size_t lastPossibleBorderStr1 = 0;
-	size_t lastPossibleBorderStr2 = 0;
-	bool borderFoundStr1 = false;
-	bool borderFoundStr2 = false;
-	bool stillEqual = true;
-	while (true)
+	size_t length = types.nextLMSType(str1)-str1;
+	if (types.nextLMSType(str2)-str2 != length)
 	{
-		if (stillEqual)
-		{
-			if (text[str1] != text[str2])
-			{
-				stillEqual = false;
-				if (lastPossibleBorderStr1 == 0 || lastPossibleBorderStr2 == 0)
-				{
-					return false;
-				}
-			}
-			else
-			{
-				numEquals++;
-			}
-		}
-		if (!borderFoundStr1 && text[str1] < text[str1-1])
+		return false;
+	}
+	assert(str1+length < textLen && str2+length < textLen);
+	//the substrings include the LMS-type symbols that end them
+	return firstMismatch(text+str1, text+str2, length+1) == length+1;
+}
+
+//the LMS-type index which ends the LMS substring starting at start, without knowing the types
+//it's where the last drop in the text before the first rise after a drop is, or the sentinel at the end
+//the neighbours are compared 64 at a time with the kernel and the drops and rises are found from the bitmasks
+template <class Alphabet>
+size_t LMSSubstringEnd(const Alphabet* text, size_t textLen, size_t start)
+{
+	bool dropped = false;
+	size_t lastDrop = textLen-1;
+	for (size_t pos = start; pos < textLen; pos += 64)
+	{
+		uint64_t rises;
+		uint64_t drops;
+		//bit j compares pos+j to pos+j+1, so a drop at bit j means pos+j+1 is smaller than the symbol before it
+		compareNeighbours(text, textLen, pos, std::min((size_t)64, textLen-pos), &rises, &drops);
+		if (!dropped)
 		{
-			lastPossibleBorderStr1 = pos;
-			if (str1 == textLen-1)
+			if (drops == 0)
 			{
-				borderFoundStr1 = true;
+				continue;
 			}
+			size_t firstDrop = __builtin_ctzll(drops);
+			dropped = true;
+			lastDrop = pos+firstDrop+1;
+			rises = firstDrop == 63 ? 0 : rises & (~(uint64_t)0 << (firstDrop+1));
 		}
-		if (!borderFoundStr2 && text[str2] < text[str2-1])
+		if (rises != 0)
 		{
-			lastPossibleBorderStr2 = pos;
-			if (str2 == textLen-1)
+			size_t firstRise = __builtin_ctzll(rises);
+			uint64_t dropsBefore = drops & (((uint64_t)1 << firstRise)-1);
+			if (dropsBefore != 0)
 			{
-				borderFoundStr2 = true;
+				lastDrop = pos+(63-__builtin_clzll(dropsBefore))+1;
 			}
+			return lastDrop;
 		}
-		if (text[str1] > text[str1-1] && lastPossibleBorderStr1 != 0)
-		{
-			borderFoundStr1 = true;
-		}
-		if (text[str2] > text[str2-1] && lastPossibleBorderStr2 != 0)
-		{
-			borderFoundStr2 = true;
-		}
-		if (borderFoundStr1 && numEquals < lastPossibleBorderStr1)
+		if (drops != 0)
 		{
-			return false;
+			lastDrop = pos+(63-__builtin_clzll(drops))+1;
 		}
-		if (borderFoundStr2 && numEquals < lastPossibleBorderStr2)
-		{
-			return false;
-		}
-		if (borderFoundStr2 && borderFoundStr1)
-		{
-			if (lastPossibleBorderStr2 != lastPossibleBorderStr1)
-			{
-				return false;
-			}
-			if (numEquals < lastPossibleBorderStr2)
-			{
-				return false;
-			}
-			return true;
-		}
-		str1++;
-		str2++;
-		pos++;
 	}
-	assert(false);
+	return lastDrop;
+}
+
+//because this only checks equality, it doesn't need to know whether the suffixes are L-type or S-type
+//Doesn't need information about LMS substring borders to test substring equality, the borders are found from the text
+template <class Alphabet>
+bool LMSSubstringsAreEqualNoBorder(const Alphabet* text, size_t textLen, size_t str1, size_t str2)
+{
+	if (text[str1] != text[str2])
+	{
+		return false;
+	}
+	size_t length = LMSSubstringEnd(text, textLen, str1)-str1;
+	if (LMSSubstringEnd(text, textLen, str2)-str2 != length)
+	{
+		return false;
+	}
+	return firstMismatch(text+str1, text+str2, length+1) == length+1;
 }
 
 //used only in debugging to check that the LMS-substrings are ordered correctly by steps 1-3
@@ -880,78 +1916,199 @@ int compareLMSSubstrings(const Alphabet* text, size_t textLen, size_t str1, size
 	assert(false);
 }
 
-//used only in debugging to check that the LMS-suffixes are ordered correctly by steps 4-6
+//used only in debugging to check that the LMS-suffixes are ordered correctly by steps 4-6
+template <class Alphabet>
+int compareLMSSuffixes(const Alphabet* text, size_t textLen, size_t str1, size_t str2)
+{
+	do
+	{
+		if (text[str1] > text[str2])
+		{
+			return 1;
+		}
+		if (text[str1] < text[str2])
+		{
+			return -1;
+		}
+		str1++;
+		str2++;
+		if (str1 == textLen && str2 < textLen)
+		{
+			return -1;
+		}
+		if (str1 < textLen && str2 == textLen)
+		{
+			return 1;
+		}
+		if (str1 == textLen && str2 == textLen)
+		{
+			return 0;
+		}
+	} while (true);
+	assert(false);
+}
+
+//the bytes of the narrowest of unsigned char, uint16_t, uint32_t and size_t which holds maxSymbol
+inline size_t symbolBytesFor(size_t maxSymbol)
+{
+	if (maxSymbol <= std::numeric_limits<unsigned char>::max())
+	{
+		return sizeof(unsigned char);
+	}
+	if (maxSymbol <= std::numeric_limits<uint16_t>::max())
+	{
+		return sizeof(uint16_t);
+	}
+	if (maxSymbol <= std::numeric_limits<uint32_t>::max())
+	{
+		return sizeof(uint32_t);
+	}
+	return sizeof(size_t);
+}
+
+template <class Alphabet>
+void writeSymbolAs(std::ostream& out, size_t symbol)
+{
+	Alphabet write = symbol;
+	assert(write == symbol);
+	out.write((char*)&write, sizeof(Alphabet));
+}
+
+inline void writeSymbol(std::ostream& out, size_t symbol, size_t symbolBytes)
+{
+	switch(symbolBytes)
+	{
+		case sizeof(unsigned char):
+			writeSymbolAs<unsigned char>(out, symbol);
+			break;
+		case sizeof(uint16_t):
+			writeSymbolAs<uint16_t>(out, symbol);
+			break;
+		case sizeof(uint32_t):
+			writeSymbolAs<uint32_t>(out, symbol);
+			break;
+		default:
+			writeSymbolAs<size_t>(out, symbol);
+			break;
+	}
+}
+
+//fingerprint of an LMS substring, a polynomial hash modulo 2^61-1 of its symbols and its length
+//equal substrings have equal fingerprints, so only neighbours with equal fingerprints have to be compared symbol by symbol
+struct LMSFingerprint
+{
+	uint64_t hash;
+	size_t length;
+	bool operator==(const LMSFingerprint& second) const { return hash == second.hash && length == second.length; };
+};
+
+inline uint64_t fingerprintStep(uint64_t hash, uint64_t symbol)
+{
+	const uint64_t modulus = ((uint64_t)1 << 61)-1;
+	const uint64_t base = 0x9e3779b1;
+	unsigned __int128 product = (unsigned __int128)hash*base+symbol%modulus+1;
+	uint64_t folded = (uint64_t)(product & modulus)+(uint64_t)(product >> 61);
+	return folded >= modulus ? folded-modulus : folded;
+}
+
+//the substring runs up to and including the next LMS-type index, the sentinel's substring is only the sentinel
 template <class Alphabet>
-int compareLMSSuffixes(const Alphabet* text, size_t textLen, size_t str1, size_t str2)
+LMSFingerprint fingerprintLMSSubstring(const Alphabet* text, size_t textLen, size_t start, const SuffixTypes& types)
 {
-	do
+	size_t end = std::min(types.nextLMSType(start)+1, textLen);
+	uint64_t hash = 0;
+	for (size_t i = start; i < end; i++)
 	{
-		if (text[str1] > text[str2])
-		{
-			return 1;
-		}
-		if (text[str1] < text[str2])
-		{
-			return -1;
-		}
-		str1++;
-		str2++;
-		if (str1 == textLen && str2 < textLen)
-		{
-			return -1;
-		}
-		if (str1 < textLen && str2 == textLen)
+		hash = fingerprintStep(hash, text[i]);
+	}
+	LMSFingerprint ret;
+	ret.hash = hash;
+	ret.length = end-start;
+	return ret;
+}
+
+//step 4 names the sorted LMS substrings in blocks, the fingerprints and the comparisons of a block are done in parallel
+const size_t namingBlock = (size_t)1 << 16;
+
+//isNew[i] tells whether sorted[i] differs from the substring before it
+//previous and previousFingerprint are the last substring of the previous block, unless first is set, and are updated for the next block
+template <class Alphabet, class IndexType>
+void findNewLMSSubstrings(const Alphabet* text, size_t textLen, const SuffixTypes& types, const IndexType* sorted, size_t count, bool first, IndexType& previous, LMSFingerprint& previousFingerprint, std::vector<LMSFingerprint>& fingerprints, std::vector<char>& isNew)
+{
+	assert(count > 0 && fingerprints.size() >= count && isNew.size() >= count);
+	forPieces(count, minParallelInductionBlock, [&](size_t start, size_t end)
+	{
+		for (size_t i = start; i < end; i++)
 		{
-			return 1;
+			fingerprints[i] = fingerprintLMSSubstring(text, textLen, sorted[i], types);
 		}
-		if (str1 == textLen && str2 == textLen)
+	});
+	forPieces(count, minParallelInductionBlock, [&](size_t start, size_t end)
+	{
+		for (size_t i = start; i < end; i++)
 		{
-			return 0;
+			if (i == 0 && first)
+			{
+				isNew[i] = true;
+				continue;
+			}
+			IndexType before = i == 0 ? previous : sorted[i-1];
+			const LMSFingerprint& beforeFingerprint = i == 0 ? previousFingerprint : fingerprints[i-1];
+			isNew[i] = !(beforeFingerprint == fingerprints[i]) || !LMSSubstringsAreEqual(text, textLen, before, sorted[i], types);
+			assert(isNew[i] == !LMSSubstringsAreEqual(text, textLen, before, sorted[i], types));
 		}
-	} while (true);
-	assert(false);
+	});
+	previous = sorted[count-1];
+	previousFingerprint = fingerprints[count-1];
 }
 
 //high memory alternative used for in-memory BWT
 //returns whether the output can be directly BWT'd and the max alphabet
 template <class Alphabet, class IndexType>
-std::tuple<bool, size_t> step4(const Alphabet* text, size_t textLen, size_t maxAlphabet, std::ostream& out, std::istream& LMSLeft, size_t LMSLeftSize)
+std::tuple<bool, size_t> step4(const Alphabet* text, size_t textLen, size_t maxAlphabet, std::ostream& out, std::istream& LMSLeft, size_t LMSLeftSize, const SuffixTypes& types)
 {
 	std::tuple<bool, size_t> ret;
 	std::get<0>(ret) = true;
 	std::get<1>(ret) = 0;
-	std::vector<bool> LMSSubstringBorder(textLen, false);
-	for (size_t i = 0; i < LMSLeftSize; i++)
-	{
-		IndexType index;
-		assert(LMSLeft.good());
-		LMSLeft.read((char*)&index, sizeof(IndexType));
-		LMSSubstringBorder[index] = true;
-	}
-	LMSLeft.clear();
-	LMSLeft.seekg(0);
-	assert(LMSLeft.good());
 	std::vector<IndexType> sparseSPrime((textLen+1)/2, 0); //not sure if needs to round up, do it just in case
 	IndexType currentName = LMSLeftSize+1;
 	IndexType oldIndex = 0;
-	IndexType index = 0;
-	for (size_t i = 0; i < LMSLeftSize; i++)
-	{
+	LMSFingerprint oldFingerprint = LMSFingerprint();
+	std::vector<IndexType> sorted(std::min(namingBlock, LMSLeftSize));
+	std::vector<LMSFingerprint> fingerprints(sorted.size());
+	std::vector<char> isNew(sorted.size());
+	std::vector<IndexType> names(sorted.size());
+	size_t count = 0;
+	for (size_t blockStart = 0; blockStart < LMSLeftSize; blockStart += count)
+	{
+		count = std::min(namingBlock, LMSLeftSize-blockStart);
 		assert(LMSLeft.good());
-		LMSLeft.read((char*)&index, sizeof(IndexType));
-		if (i == 0 || !LMSSubstringsAreEqual(text, textLen, oldIndex, index, LMSSubstringBorder))
+		LMSLeft.read((char*)sorted.data(), count*sizeof(IndexType));
+		findNewLMSSubstrings(text, textLen, types, sorted.data(), count, blockStart == 0, oldIndex, oldFingerprint, fingerprints, isNew);
+		//the names are a prefix sum of the new substrings, so they can be written in parallel after it
+		for (size_t i = 0; i < count; i++)
 		{
-			currentName--;
+			if (isNew[i])
+			{
+				currentName--;
+			}
+			else
+			{
+				//lms substrings are equal
+				std::get<0>(ret) = false;
+			}
+			assert(currentName > 0);
+			names[i] = currentName;
 		}
-		else if (i != 0)
+		forPieces(count, minParallelInductionBlock, [&](size_t start, size_t end)
 		{
-			//lms substrings are equal
-			std::get<0>(ret) = false;
-		}
-		assert(index/2 < (textLen+1)/2);
-		sparseSPrime[index/2] = currentName;
-		assert(currentName > 0);
-		oldIndex = index;
+			for (size_t i = start; i < end; i++)
+			{
+				assert(types.isLMSType(sorted[i]) || sorted[i] == textLen-1);
+				assert(sorted[i]/2 < (textLen+1)/2);
+				sparseSPrime[sorted[i]/2] = names[i];
+			}
+		});
 	}
 	for (auto i = sparseSPrime.begin(); i != sparseSPrime.end(); i++)
 	{
@@ -973,7 +2130,7 @@ std::tuple<bool, size_t> step4(const Alphabet* text, size_t textLen, size_t maxA
 //low memory alternative used for in-file BWT
 //returns whether the output can be directly BWT'd and the max alphabet
 template <class Alphabet, class IndexType>
-std::tuple<bool, size_t> step4LowMemory(const Alphabet* text, size_t textLen, size_t maxAlphabet, size_t k, std::ostream& out, std::istream& LMSLeft, size_t LMSLeftSize)
+std::tuple<bool, size_t> step4LowMemory(const Alphabet* text, size_t textLen, size_t maxAlphabet, size_t k, std::ostream& out, std::istream& LMSLeft, size_t LMSLeftSize, const SuffixTypes* types)
 {
 	std::tuple<bool, size_t> ret;
 	std::get<0>(ret) = true;
@@ -983,24 +2140,69 @@ std::tuple<bool, size_t> step4LowMemory(const Alphabet* text, size_t textLen, si
 	IndexType currentName = LMSLeftSize+1;
 	IndexType oldIndex = 0;
 	IndexType index = 0;
-	for (size_t i = 0; i < LMSLeftSize; i++)
-	{
-		assert(LMSLeft.good());
-		LMSLeft.read((char*)&index, sizeof(IndexType));
-		if (i == 0 || !LMSSubstringsAreEqualNoBorder(text, textLen, oldIndex, index))
+	if (types != nullptr)
+	{
+		LMSFingerprint oldFingerprint = LMSFingerprint();
+		std::vector<IndexType> sorted(std::min(namingBlock, LMSLeftSize));
+		std::vector<LMSFingerprint> fingerprints(sorted.size());
+		std::vector<char> isNew(sorted.size());
+		size_t count = 0;
+		for (size_t blockStart = 0; blockStart < LMSLeftSize; blockStart += count)
 		{
-			currentName--;
+			count = std::min(namingBlock, LMSLeftSize-blockStart);
+			assert(LMSLeft.good());
+			LMSLeft.read((char*)sorted.data(), count*sizeof(IndexType));
+			findNewLMSSubstrings(text, textLen, *types, sorted.data(), count, blockStart == 0, oldIndex, oldFingerprint, fingerprints, isNew);
+			for (size_t i = 0; i < count; i++)
+			{
+				if (isNew[i])
+				{
+					currentName--;
+				}
+				else
+				{
+					//lms substrings are equal
+					std::get<0>(ret) = false;
+				}
+				assert(sorted[i]/2 < (textLen+1)/2);
+				sparseSPrime.insert(currentName, sorted[i]/2);
+				assert(currentName > 0);
+			}
 		}
-		else if (i != 0)
+	}
+	else
+	{
+		//without the types the borders aren't known, so the substrings are compared one pair at a time
+		for (size_t i = 0; i < LMSLeftSize; i++)
 		{
-			//lms substrings are equal
-			std::get<0>(ret) = false;
+			assert(LMSLeft.good());
+			LMSLeft.read((char*)&index, sizeof(IndexType));
+			bool equal;
+			if (i == 0)
+			{
+				equal = false;
+			}
+			else
+			{
+				equal = LMSSubstringsAreEqualNoBorder(text, textLen, oldIndex, index);
+			}
+			if (!equal)
+			{
+				currentName--;
+			}
+			else if (i != 0)
+			{
+				//lms substrings are equal
+				std::get<0>(ret) = false;
+			}
+			assert(index/2 < (textLen+1)/2);
+			sparseSPrime.insert(currentName, index/2);
+			assert(currentName > 0);
+			oldIndex = index;
 		}
-		assert(index/2 < (textLen+1)/2);
-		sparseSPrime.insert(currentName, index/2);
-		assert(currentName > 0);
-		oldIndex = index;
 	}
+	//S' is written with the narrowest alphabet that holds the names, the recursion runs on that alphabet
+	size_t symbolBytes = symbolBytesFor(LMSLeftSize-currentName);
 	while (!sparseSPrime.empty())
 	{
 		IndexType write = sparseSPrime.get()-currentName;
@@ -1009,34 +2211,21 @@ std::tuple<bool, size_t> step4LowMemory(const Alphabet* text, size_t textLen, si
 			std::get<1>(ret) = write;
 		}
 		assert(write < LMSLeftSize);
-		out.write((char*)&write, sizeof(IndexType));
+		writeSymbol(out, write, symbolBytes);
 	}
+	assert(std::get<1>(ret) == LMSLeftSize-currentName);
 	return ret;
 }
 
-//do a counting sort on the rotated strings and pick the last element
-template <class IndexType>
-std::vector<IndexType> bwtDirectly(const std::vector<IndexType>& data)
+//the symbols are all different, so the rotations are sorted by their first symbol and the last one is the one before it
+template <class Alphabet>
+std::vector<Alphabet> bwtDirectly(const std::vector<Alphabet>& data)
 {
-	auto max = std::max_element(data.begin(), data.end());
-	assert(*max == data.size()-1);
-	std::vector<IndexType> location(*max+1, 0);
+	assert(*std::max_element(data.begin(), data.end()) == data.size()-1);
+	std::vector<Alphabet> ret(data.size(), 0);
 	for (size_t i = 0; i < data.size(); i++)
 	{
-		location[data[i]] = i+1; //use indexes that start from 1 so 0 is reserved as "unused"
-	}
-	std::vector<IndexType> ret;
-	for (auto i = location.begin(); i != location.end(); i++)
-	{
-		if (*i != 0)
-		{
-			IndexType loc = *i-2;
-			if (*i == 1)
-			{
-				loc = data.size()-1;
-			}
-			ret.push_back(data[loc]);
-		}
+		ret[data[i]] = data[i == 0 ? data.size()-1 : i-1];
 	}
 	return ret;
 }
@@ -1053,17 +2242,52 @@ std::vector<IndexType> step5(const std::vector<IndexType>& Sprime, bool canBWTDi
 	return result;
 }
 
-template <class IndexType>
-void step5InFile(const std::string& SprimeFile, const std::string& outFile, size_t maxMemory, size_t SprimeSize, bool canBWTDirectly, size_t maxAlphabet)
+//a step of the in-files BWT has at most this many streams open, their buffers get a sixteenth of its memory
+const size_t maxOpenStreams = 3;
+
+inline size_t streamBufferBytes(size_t maxMemory)
+{
+	return std::max(ioAlignment, std::min((size_t)FileStreambuffer::maxBufferBytes, alignDown(maxMemory/16/maxOpenStreams/2)));
+}
+
+//S' is stored with Alphabet, the narrowest alphabet which holds its names
+//instead of its BWT this writes the inverse suffix array of S', which is all step 6 needs, with ranksBytes bytes per rank
+template <class Alphabet>
+void step5InFile(const std::string& SprimeFile, const std::string& outFile, size_t maxMemory, size_t SprimeSize, bool canBWTDirectly, size_t maxAlphabet, size_t ranksBytes)
 {
 	if (canBWTDirectly)
 	{
-		std::vector<IndexType> SprimeVec = readVectorFromFile<IndexType>(SprimeFile, false);
-		std::vector<IndexType> result = bwtDirectly(SprimeVec);
-		writeVectorToFile(result, outFile);
+		//every name is unique so the name of a suffix is its rank
+		FileStreambuffer SprimeReaderBuf(SprimeFile, FileStreambuffer::READ, streamBufferBytes(maxMemory));
+		std::istream SprimeReader(&SprimeReaderBuf);
+		FileStreambuffer outWriterBuf(outFile, FileStreambuffer::WRITE, streamBufferBytes(maxMemory));
+		std::ostream outWriter(&outWriterBuf);
+		for (size_t i = 0; i < SprimeSize; i++)
+		{
+			Alphabet name;
+			SprimeReader.read((char*)&name, sizeof(Alphabet));
+			writeSymbol(outWriter, name, ranksBytes);
+		}
+		return;
+	}
+	//the in-files recursion keeps S' and maxMemory bytes in memory, when the lean in-memory suffix array fits in the same it's much faster
+	size_t inMemoryPeak = suffixRanksLeanPeakBytes<Alphabet>(SprimeSize, maxAlphabet);
+	if (inMemoryPeak <= SprimeSize*sizeof(Alphabet)+maxMemory)
+	{
+#ifdef PRINTRSS
+		std::cerr << "step 5: in-memory suffix array of " << SprimeSize << " symbols, estimated peak " << inMemoryPeak << " bytes\n";
+#endif
+		std::vector<Alphabet> SprimeVec = readVectorFromFile<Alphabet>(SprimeFile, false);
+		assert(SprimeVec.size() == SprimeSize);
+		FileStreambuffer outWriterBuf(outFile, FileStreambuffer::WRITE, streamBufferBytes(maxMemory));
+		std::ostream outWriter(&outWriterBuf);
+		suffixRanksLean<Alphabet>(SprimeVec, maxAlphabet, outWriter, ranksBytes);
 		return;
 	}
-	bwtInFiles<IndexType>(SprimeFile, SprimeSize, maxAlphabet, maxMemory, outFile, false);
+#ifdef PRINTRSS
+	std::cerr << "step 5: in-files suffix ranks of " << SprimeSize << " symbols, in-memory would need " << inMemoryPeak << " bytes\n";
+#endif
+	bwtInFiles<Alphabet>(SprimeFile, SprimeSize, maxAlphabet, maxMemory, outFile, false, ranksBytes);
 }
 
 //calculate the inverse suffix array of S' by using BWT'
@@ -1129,6 +2353,30 @@ std::vector<IndexType> alternateStep6b(std::istream& SAinverse, std::istream& LM
 	return ret;
 }
 
+//low memory alternative for in-file BWT
+//the indices are scattered to their ranks through a queue instead of a vector of all of them
+template <class IndexType>
+void alternateStep6bLowMemory(std::istream& SAinverse, std::istream& LMSIndices, size_t size, size_t maxMemory, std::ostream& out)
+{
+	WeirdPriorityQueue<IndexType, IndexType> sorted(size, maxMemory);
+	for (size_t i = 0; i < size; i++)
+	{
+		IndexType SA;
+		SAinverse.read((char*)&SA, sizeof(IndexType));
+		IndexType index;
+		LMSIndices.read((char*)&index, sizeof(IndexType));
+		assert(SA < size);
+		sorted.insert(index, SA);
+	}
+	for (size_t i = 0; i < size; i++)
+	{
+		assert(!sorted.empty());
+		IndexType index = sorted.get();
+		out.write((char*)&index, sizeof(IndexType));
+	}
+	assert(sorted.empty());
+}
+
 //only for debugging
 template <class Alphabet, class IndexType>
 void verifyLMSSubstringsAreSorted(const Alphabet* source, size_t sourceLen, const std::vector<IndexType>& LMSIndices, const std::vector<bool>& isSType)
@@ -1181,12 +2429,10 @@ void bwt(const Alphabet* source, size_t sourceLen, size_t maxAlphabet, Alphabet*
 	std::vector<IndexType> charSum(maxAlphabet+2, 0);
 	std::vector<IndexType> LMSIndices(sourceLen/2, 0);
 
-	MemoryStreambuffer<Alphabet> sourceBuf((Alphabet*)source, sourceLen);
 	MemoryStreambuffer<IndexType> LMSLeftBuf(LMSLeft.data(), sourceLen/2);
 	MemoryStreambuffer<IndexType> charSumBuf(charSum.data(), maxAlphabet+2);
 	MemoryStreambuffer<IndexType> LMSIndicesBuf(LMSIndices.data(), sourceLen/2);
 
-	std::istream sourceReader(&sourceBuf);
 	std::istream LMSLeftReader(&LMSLeftBuf);
 //	std::istream charSumReader(&charSumBuf);
 	std::istream LMSIndicesReader(&LMSIndicesBuf);
@@ -1195,7 +2441,8 @@ void bwt(const Alphabet* source, size_t sourceLen, size_t maxAlphabet, Alphabet*
 	std::ostream charSumWriter(&charSumBuf);
 	std::ostream LMSIndicesWriter(&LMSIndicesBuf);
 
-	auto prep = preprocess<Alphabet, IndexType>(sourceReader, sourceLen, maxAlphabet, LMSLeftWriter, charSumWriter, LMSIndicesWriter, false);
+	SuffixTypes types(sourceLen);
+	auto prep = preprocess<Alphabet, IndexType>(source, sourceLen, maxAlphabet, LMSLeftWriter, charSumWriter, LMSIndicesWriter, false, &types);
 
 	assert(std::get<1>(prep) <= sourceLen/2);
 	LMSLeft.resize(std::get<1>(prep));
@@ -1206,7 +2453,7 @@ void bwt(const Alphabet* source, size_t sourceLen, size_t maxAlphabet, Alphabet*
 	std::ostream secondWriter(&secondBuf);
 	std::istream secondReader(&secondBuf);
 
-	step2or7<Alphabet, IndexType, false>(source, sourceLen, maxAlphabet, secondWriter, LMSLeftReader, std::get<1>(prep), (Alphabet*)nullptr, charSum, std::get<0>(prep));
+	step2or7<Alphabet, IndexType, false>(source, sourceLen, maxAlphabet, secondWriter, LMSLeftReader, std::get<1>(prep), (Alphabet*)nullptr, charSum, std::get<0>(prep), types);
 	freeMemory(LMSLeft);
 
 	std::vector<IndexType> third(std::get<1>(prep), 0);
@@ -1214,7 +2461,7 @@ void bwt(const Alphabet* source, size_t sourceLen, size_t maxAlphabet, Alphabet*
 	std::ostream thirdWriter(&thirdBuf);
 	std::istream thirdReader(&thirdBuf);
 
-	step3or8<Alphabet, IndexType, false>(source, sourceLen, maxAlphabet, thirdWriter, secondReader, std::get<1>(prep), (Alphabet*)nullptr, charSum, std::get<0>(prep));
+	step3or8<Alphabet, IndexType, false>(source, sourceLen, maxAlphabet, thirdWriter, secondReader, std::get<1>(prep), (Alphabet*)nullptr, charSum, std::get<0>(prep), types);
 	freeMemory(second);
 #ifndef NDEBUG
 	verifyLMSSubstringsAreSorted<Alphabet, IndexType>(source, sourceLen, third, std::get<2>(prep));
@@ -1224,7 +2471,7 @@ void bwt(const Alphabet* source, size_t sourceLen, size_t maxAlphabet, Alphabet*
 	MemoryStreambuffer<IndexType> fourthBuf(fourth.data(), std::get<1>(prep));
 	std::ostream fourthWriter(&fourthBuf);
 
-	auto fourthRet = step4<Alphabet, IndexType>(source, sourceLen, maxAlphabet, fourthWriter, thirdReader, std::get<1>(prep));
+	auto fourthRet = step4<Alphabet, IndexType>(source, sourceLen, maxAlphabet, fourthWriter, thirdReader, std::get<1>(prep), types);
 	freeMemory(third);
 	auto fifth = step5<IndexType>(fourth, std::get<0>(fourthRet), std::get<1>(fourthRet));
 
@@ -1251,35 +2498,306 @@ void bwt(const Alphabet* source, size_t sourceLen, size_t maxAlphabet, Alphabet*
 	std::ostream seventhWriter(&seventhBuf);
 	std::istream seventhReader(&seventhBuf);
 
-	step2or7<Alphabet, IndexType, true>(source, sourceLen, maxAlphabet, seventhWriter, sixthReader, sixth.size(), dest, charSum, std::get<0>(prep));
+	step2or7<Alphabet, IndexType, true>(source, sourceLen, maxAlphabet, seventhWriter, sixthReader, sixth.size(), dest, charSum, std::get<0>(prep), types);
 	freeMemory(sixth);
 	std::ofstream dummyStream;
-	step3or8<Alphabet, IndexType, true>(source, sourceLen, maxAlphabet, dummyStream, seventhReader, std::get<1>(prep), dest, charSum, std::get<0>(prep));
+	step3or8<Alphabet, IndexType, true>(source, sourceLen, maxAlphabet, dummyStream, seventhReader, std::get<1>(prep), dest, charSum, std::get<0>(prep), types);
+}
+
+template <class Alphabet>
+void bwt(const Alphabet* source, size_t sourceLen, size_t maxAlphabet, Alphabet* dest)
+{
+	if (sourceLen < 255)
+	{
+		bwt<Alphabet, unsigned char>(source, sourceLen, maxAlphabet, dest);
+	}
+	else if (sourceLen < std::numeric_limits<uint16_t>::max())
+	{
+		bwt<Alphabet, uint16_t>(source, sourceLen, maxAlphabet, dest);
+	}
+	else if (sourceLen < std::numeric_limits<uint32_t>::max())
+	{
+		bwt<Alphabet, uint32_t>(source, sourceLen, maxAlphabet, dest);
+	}
+	else
+	{
+		bwt<Alphabet, size_t>(source, sourceLen, maxAlphabet, dest);
+	}
+}
+
+//the lean in-memory BWT is the standard SA-IS in a single workspace of textLen indices
+//the sorted LMS substrings, their names, the reduced text and the recursion all reuse the workspace
+//so the peak is the text, the workspace and textLen/8 bytes of suffix types
+//unused workspace slots are marked with the largest index, which bwtLean never uses for a text index
+template <class Alphabet, class IndexType>
+void leanBuckets(const Alphabet* text, size_t textLen, size_t alphabetSize, IndexType* bucket, bool ends)
+{
+	std::fill(bucket, bucket+alphabetSize, 0);
+	for (size_t i = 0; i < textLen; i++)
+	{
+		assert(text[i] < alphabetSize);
+		bucket[text[i]]++;
+	}
+	//like charSum, either the starts or the ends of the buckets
+	IndexType sum = 0;
+	for (size_t a = 0; a < alphabetSize; a++)
+	{
+		sum += bucket[a];
+		bucket[a] = ends ? sum : sum-bucket[a];
+	}
+}
+
+//the text ends with a sentinel which is smaller than any other symbol, so the last suffix is S-type
+template <class Alphabet>
+SuffixTypes leanSuffixTypes(const Alphabet* text, size_t textLen)
+{
+	SuffixTypes types(textLen);
+	size_t runStart = textLen-1;
+	bool nextIsSType = true;
+	for (size_t i = textLen-1; i > 0; i--)
+	{
+		bool isSType = text[i-1] < text[i] || (text[i-1] == text[i] && nextIsSType);
+		if (isSType && !nextIsSType)
+		{
+			runStart = i-1;
+		}
+		if (!isSType && nextIsSType)
+		{
+			types.setSType(i, runStart+1);
+		}
+		nextIsSType = isSType;
+	}
+	if (nextIsSType)
+	{
+		types.setSType(0, runStart+1);
+	}
+	return types;
+}
+
+//induces the L-type suffixes from the LMS-type suffixes and then the S-type suffixes from the L-type suffixes
+template <class Alphabet, class IndexType>
+void leanInduce(const Alphabet* text, size_t textLen, size_t alphabetSize, const SuffixTypes& types, IndexType* SA, IndexType* bucket)
+{
+	const IndexType empty = std::numeric_limits<IndexType>::max();
+	leanBuckets(text, textLen, alphabetSize, bucket, false);
+	for (size_t i = 0; i < textLen; i++)
+	{
+		IndexType index = SA[i];
+		if (index != empty && index > 0 && !types.isSType(index-1))
+		{
+			SA[bucket[text[index-1]]++] = index-1;
+		}
+	}
+	leanBuckets(text, textLen, alphabetSize, bucket, true);
+	for (size_t i = textLen; i > 0; i--)
+	{
+		IndexType index = SA[i-1];
+		if (index != empty && index > 0 && types.isSType(index-1))
+		{
+			SA[--bucket[text[index-1]]] = index-1;
+		}
+	}
+}
+
+//SA has textLen+freeSpace slots, the buckets go into the free space at the end if they fit
+template <class Alphabet, class IndexType>
+void leanSuffixArray(const Alphabet* text, size_t textLen, size_t alphabetSize, IndexType* SA, size_t freeSpace)
+{
+	const IndexType empty = std::numeric_limits<IndexType>::max();
+	if (textLen == 1)
+	{
+		SA[0] = 0;
+		return;
+	}
+	SuffixTypes types = leanSuffixTypes(text, textLen);
+	std::vector<IndexType> ownBucket;
+	IndexType* bucket;
+	if (freeSpace >= alphabetSize)
+	{
+		bucket = SA+textLen+freeSpace-alphabetSize;
+	}
+	else
+	{
+		ownBucket.resize(alphabetSize);
+		bucket = ownBucket.data();
+	}
+
+	//sort the LMS substrings by inducing from the unsorted LMS-type suffixes at the ends of their buckets
+	std::fill(SA, SA+textLen, empty);
+	leanBuckets(text, textLen, alphabetSize, bucket, true);
+	for (size_t i = 1; i < textLen; i++)
+	{
+		if (types.isLMSType(i))
+		{
+			SA[--bucket[text[i]]] = i;
+		}
+	}
+	leanInduce(text, textLen, alphabetSize, types, SA, bucket);
+	size_t LMSCount = 0;
+	for (size_t i = 0; i < textLen; i++)
+	{
+		if (types.isLMSType(SA[i]))
+		{
+			SA[LMSCount++] = SA[i];
+		}
+	}
+	assert(LMSCount <= textLen/2);
+
+	//name the LMS substrings, the name of the one at index i goes to LMSCount+i/2, LMS-type indices are never next to each other
+	std::fill(SA+LMSCount, SA+textLen, empty);
+	size_t names = 0;
+	size_t previous = 0;
+	for (size_t i = 0; i < LMSCount; i++)
+	{
+		size_t current = SA[i];
+		if (i == 0 || !LMSSubstringsAreEqual(text, textLen, previous, current, types))
+		{
+			names++;
+		}
+		previous = current;
+		SA[LMSCount+current/2] = names-1;
+	}
+	//the names in text order are the reduced text, at the end of the workspace
+	size_t reducedStart = textLen;
+	for (size_t i = textLen; i > LMSCount; i--)
+	{
+		if (SA[i-1] != empty)
+		{
+			SA[--reducedStart] = SA[i-1];
+		}
+	}
+	assert(reducedStart == textLen-LMSCount);
+	IndexType* reduced = SA+reducedStart;
+
+	//sort the reduced suffixes into the start of the workspace
+	if (names < LMSCount)
+	{
+		//the types and buckets are rebuilt after the recursion so they don't add up over the levels
+		types = SuffixTypes();
+		freeMemory(ownBucket);
+		leanSuffixArray<IndexType, IndexType>(reduced, LMSCount, names, SA, textLen-2*LMSCount);
+		types = leanSuffixTypes(text, textLen);
+		if (freeSpace < alphabetSize)
+		{
+			ownBucket.resize(alphabetSize);
+			bucket = ownBucket.data();
+		}
+	}
+	else
+	{
+		for (size_t i = 0; i < LMSCount; i++)
+		{
+			SA[reduced[i]] = i;
+		}
+	}
+
+	//the reduced text isn't needed anymore, its space holds the LMS-type indices in text order
+	size_t LMSIndex = 0;
+	for (size_t i = 1; i < textLen; i++)
+	{
+		if (types.isLMSType(i))
+		{
+			reduced[LMSIndex++] = i;
+		}
+	}
+	assert(LMSIndex == LMSCount);
+	for (size_t i = 0; i < LMSCount; i++)
+	{
+		SA[i] = reduced[SA[i]];
+	}
+	//the sorted LMS-type suffixes go to the ends of their buckets, going backwards never overwrites one that hasn't moved yet
+	std::fill(SA+LMSCount, SA+textLen, empty);
+	leanBuckets(text, textLen, alphabetSize, bucket, true);
+	for (size_t i = LMSCount; i > 0; i--)
+	{
+		IndexType index = SA[i-1];
+		SA[i-1] = empty;
+		SA[--bucket[text[index]]] = index;
+	}
+	leanInduce(text, textLen, alphabetSize, types, SA, bucket);
+}
+
+template <class Alphabet, class IndexType>
+void bwtLean(const Alphabet* source, size_t sourceLen, size_t maxAlphabet, Alphabet* dest)
+{
+	assert(sizeof(Alphabet) <= sizeof(IndexType));
+	assert(sourceLen < std::numeric_limits<IndexType>::max());
+	std::vector<IndexType> SA(sourceLen, 0);
+	leanSuffixArray<Alphabet, IndexType>(source, sourceLen, maxAlphabet+1, SA.data(), 0);
+	//the BWT is written over the suffix array from the start, symbol i ends before index i of the array so that's read first
+	char* transformed = (char*)SA.data();
+	for (size_t i = 0; i < sourceLen; i++)
+	{
+		IndexType index = SA[i];
+		Alphabet symbol = source[index == 0 ? sourceLen-1 : index-1];
+		memcpy(transformed+i*sizeof(Alphabet), &symbol, sizeof(Alphabet));
+	}
+	memcpy(dest, transformed, sourceLen*sizeof(Alphabet));
+}
+
+template <class Alphabet>
+bool bwtLeanUses32BitIndices(size_t sourceLen)
+{
+	return sizeof(Alphabet) <= sizeof(uint32_t) && sourceLen < std::numeric_limits<uint32_t>::max();
+}
+
+template <class Alphabet>
+void bwtLean(const Alphabet* source, size_t sourceLen, size_t maxAlphabet, Alphabet* dest)
+{
+	if (bwtLeanUses32BitIndices<Alphabet>(sourceLen))
+	{
+		bwtLean<Alphabet, uint32_t>(source, sourceLen, maxAlphabet, dest);
+	}
+	else
+	{
+		bwtLean<Alphabet, size_t>(source, sourceLen, maxAlphabet, dest);
+	}
+}
+
+//writes the rank of every suffix in text order with ranksBytes bytes each, the text is freed once the suffix array is done
+template <class Alphabet, class IndexType>
+void suffixRanksLean(std::vector<Alphabet>& source, size_t maxAlphabet, std::ostream& out, size_t ranksBytes)
+{
+	size_t sourceLen = source.size();
+	assert(sourceLen < std::numeric_limits<IndexType>::max());
+	std::vector<IndexType> SA(sourceLen, 0);
+	leanSuffixArray<Alphabet, IndexType>(source.data(), sourceLen, maxAlphabet+1, SA.data(), 0);
+	freeMemory(source);
+	std::vector<IndexType> ranks(sourceLen, 0);
+	for (size_t i = 0; i < sourceLen; i++)
+	{
+		ranks[SA[i]] = i;
+	}
+	freeMemory(SA);
+	for (size_t i = 0; i < sourceLen; i++)
+	{
+		writeSymbol(out, ranks[i], ranksBytes);
+	}
+}
+
+//the suffix array with either the text, the suffix types and the top level buckets or the ranks
+template <class Alphabet>
+size_t suffixRanksLeanPeakBytes(size_t sourceLen, size_t maxAlphabet)
+{
+	size_t indexBytes = bwtLeanUses32BitIndices<Alphabet>(sourceLen) ? sizeof(uint32_t) : sizeof(size_t);
+	return sourceLen*indexBytes+std::max(sourceLen*sizeof(Alphabet)+SuffixTypes::bytesFor(sourceLen)+(maxAlphabet+1)*indexBytes, sourceLen*indexBytes);
 }
 
 template <class Alphabet>
-void bwt(const Alphabet* source, size_t sourceLen, size_t maxAlphabet, Alphabet* dest)
+void suffixRanksLean(std::vector<Alphabet>& source, size_t maxAlphabet, std::ostream& out, size_t ranksBytes)
 {
-	if (sourceLen < 255)
-	{
-		bwt<Alphabet, unsigned char>(source, sourceLen, maxAlphabet, dest);
-	}
-	else if (sourceLen < std::numeric_limits<uint16_t>::max())
-	{
-		bwt<Alphabet, uint16_t>(source, sourceLen, maxAlphabet, dest);
-	}
-	else if (sourceLen < std::numeric_limits<uint32_t>::max())
+	if (bwtLeanUses32BitIndices<Alphabet>(source.size()))
 	{
-		bwt<Alphabet, uint32_t>(source, sourceLen, maxAlphabet, dest);
+		suffixRanksLean<Alphabet, uint32_t>(source, maxAlphabet, out, ranksBytes);
 	}
 	else
 	{
-		bwt<Alphabet, size_t>(source, sourceLen, maxAlphabet, dest);
+		suffixRanksLean<Alphabet, size_t>(source, maxAlphabet, out, ranksBytes);
 	}
 }
 
 template <class Alphabet, class IndexType>
-void bwtInFiles(const std::string& sourceFile, size_t sourceLen, size_t maxAlphabet, size_t maxMemory, const std::string& destFile, bool addSentinel)
+void bwtInFiles(const std::string& sourceFile, size_t sourceLen, size_t maxAlphabet, size_t maxMemory, const std::string& destFile, bool addSentinel, size_t ranksBytes)
 {
 	cerrMemoryUsage("start of in-file BWT");
 
@@ -1290,63 +2808,91 @@ void bwtInFiles(const std::string& sourceFile, size_t sourceLen, size_t maxAlpha
 	std::string secondFile = getTempFileName();
 	std::string thirdFile = getTempFileName();
 	std::string fourthFile = getTempFileName();
-	std::string fifthFile = getTempFileName();
 	std::string SAinverseFile = getTempFileName();
 	std::string sixthFile = getTempFileName();
 	std::string seventhFile = getTempFileName();
 
-	std::ofstream LMSLeftWriter(LMSLeftFile, std::ios::binary);
-	std::ofstream LMSIndicesWriter(LMSIndicesFile, std::ios::binary);
-	std::ifstream sourceReader(sourceFile, std::ios::binary);
+	//the text is used through a mapping with the sentinel after the file's end, so it's read once in step 1 and shared with the page cache
+	std::unique_ptr<MappedText> sourceText(new MappedText(sourceFile, addSentinel ? sizeof(Alphabet) : 0));
+	assert(sourceText->size() == sourceLen*sizeof(Alphabet));
+	const Alphabet* source = (const Alphabet*)sourceText->data();
+
+	//the suffix types are used in steps 1-4 and 7-8 if they take at most a quarter of the extra memory, the steps' queues get the rest
+	size_t typesBytes = SuffixTypes::bytesFor(sourceLen);
+	bool useTypes = typesBytes <= maxMemory/4;
+	size_t queueMemory = useTypes ? maxMemory-typesBytes : maxMemory;
+	//every step's streams are opened and closed around the step, so the queues share the memory only with one step's buffers
+	size_t streamBytes = streamBufferBytes(maxMemory);
+	size_t streamMemory = maxOpenStreams*2*streamBytes;
+	queueMemory -= std::min(queueMemory/2, streamMemory);
+	SuffixTypes types;
+	if (useTypes)
+	{
+		types = SuffixTypes(sourceLen);
+	}
 
 	cerrMemoryUsage("before preprocessing");
 
-	auto prep = preprocessLowMemory<Alphabet, IndexType>(sourceReader, sourceLen, maxAlphabet, maxMemory, LMSLeftWriter, LMSIndicesWriter, addSentinel);
-	LMSLeftWriter.close();
-	LMSIndicesWriter.close();
-	sourceReader.close();
+	auto prep = [&]()
+	{
+		FileStreambuffer LMSLeftWriterBuf(LMSLeftFile, FileStreambuffer::WRITE, streamBytes);
+		std::ostream LMSLeftWriter(&LMSLeftWriterBuf);
+		FileStreambuffer LMSIndicesWriterBuf(LMSIndicesFile, FileStreambuffer::WRITE, streamBytes);
+		std::ostream LMSIndicesWriter(&LMSIndicesWriterBuf);
+		return preprocessLowMemory<Alphabet, IndexType>(source, sourceLen, maxAlphabet, queueMemory, LMSLeftWriter, LMSIndicesWriter, addSentinel, useTypes ? &types : nullptr);
+	}();
 
 	assert(std::get<2>(prep) <= sourceLen/2);
 
-	std::vector<Alphabet> source;
-	source = readVectorFromFile<Alphabet>(sourceFile, addSentinel);
+	//steps 2-4 read the text in the order of the induced suffixes
+	sourceText->advise(MappedText::RANDOM);
+	sourceText->advise(MappedText::WILL_NEED);
 
-	std::ofstream secondWriter(secondFile, std::ios::binary);
-	std::ifstream LMSLeftReader(LMSLeftFile, std::ios::binary);
+	{
+		FileStreambuffer secondWriterBuf(secondFile, FileStreambuffer::WRITE, streamBytes);
+		std::ostream secondWriter(&secondWriterBuf);
+		FileStreambuffer LMSLeftReaderBuf(LMSLeftFile, FileStreambuffer::READ, streamBytes);
+		std::istream LMSLeftReader(&LMSLeftReaderBuf);
 
-	cerrMemoryUsage("before step 2");
+		cerrMemoryUsage("before step 2");
 
-	step2or7LowMemory<Alphabet, IndexType, false>(source.data(), sourceLen, maxAlphabet, maxMemory, secondWriter, LMSLeftReader, std::get<2>(prep), (WeirdPriorityQueue<Alphabet, IndexType>*)nullptr, std::get<1>(prep), std::get<0>(prep));
-	secondWriter.close();
-	LMSLeftReader.close();
+		step2or7LowMemory<Alphabet, IndexType, false>(source, sourceLen, maxAlphabet, queueMemory, secondWriter, LMSLeftReader, std::get<2>(prep), (BucketWriter<Alphabet, IndexType>*)nullptr, (WeirdPriorityQueue<IndexType, IndexType>*)nullptr, std::get<1>(prep), std::get<0>(prep), useTypes ? &types : nullptr);
+	}
 
-	std::ofstream thirdWriter(thirdFile, std::ios::binary);
-	std::ifstream secondReader(secondFile, std::ios::binary);
+	{
+		FileStreambuffer thirdWriterBuf(thirdFile, FileStreambuffer::WRITE, streamBytes);
+		std::ostream thirdWriter(&thirdWriterBuf);
+		FileStreambuffer secondReaderBuf(secondFile, FileStreambuffer::READ, streamBytes);
+		std::istream secondReader(&secondReaderBuf);
 
-	cerrMemoryUsage("before step 3");
+		cerrMemoryUsage("before step 3");
 
-	step3or8LowMemory<Alphabet, IndexType, false>(source.data(), sourceLen, maxAlphabet, maxMemory, thirdWriter, secondReader, std::get<2>(prep), (WeirdPriorityQueue<Alphabet, IndexType>*)nullptr, std::get<1>(prep), std::get<0>(prep));
-	thirdWriter.close();
-	secondReader.close();
+		step3or8LowMemory<Alphabet, IndexType, false>(source, sourceLen, maxAlphabet, queueMemory, thirdWriter, secondReader, std::get<2>(prep), (BucketWriter<Alphabet, IndexType>*)nullptr, (WeirdPriorityQueue<IndexType, IndexType>*)nullptr, std::get<1>(prep), std::get<0>(prep), useTypes ? &types : nullptr);
+	}
 
 #ifndef NDEBUG
 	cerrMemoryUsage("before LMS substring order verification");
 
 	std::vector<IndexType> third = readVectorFromFile<IndexType>(thirdFile, false);
-	verifyLMSSubstringsAreSorted(source.data(), sourceLen, third, std::get<3>(prep));
+	verifyLMSSubstringsAreSorted(source, sourceLen, third, std::get<3>(prep));
 	freeMemory(third);
 #endif
 
-	std::ofstream fourthWriter(fourthFile, std::ios::binary);
-	std::ifstream thirdReader(thirdFile, std::ios::binary);
+	std::tuple<bool, size_t> fourthRet;
+	{
+		FileStreambuffer fourthWriterBuf(fourthFile, FileStreambuffer::WRITE, streamBytes);
+		std::ostream fourthWriter(&fourthWriterBuf);
+		FileStreambuffer thirdReaderBuf(thirdFile, FileStreambuffer::READ, streamBytes);
+		std::istream thirdReader(&thirdReaderBuf);
 
-	cerrMemoryUsage("before step 4");
+		cerrMemoryUsage("before step 4");
 
-	auto fourthRet = step4LowMemory<Alphabet, IndexType>(source.data(), sourceLen, maxAlphabet, maxMemory, fourthWriter, thirdReader, std::get<2>(prep));
-	fourthWriter.close();
-	thirdReader.close();
+		fourthRet = step4LowMemory<Alphabet, IndexType>(source, sourceLen, maxAlphabet, queueMemory, fourthWriter, thirdReader, std::get<2>(prep), useTypes ? &types : nullptr);
+	}
 
-	freeMemory(source);
+	sourceText->close();
+	source = nullptr;
+	types = SuffixTypes();
 	writeVectorToFile(std::get<1>(prep), charSumFile);
 	freeMemory(std::get<1>(prep));
 	writeVectorToFile(std::get<0>(prep), LCountFile);
@@ -1354,69 +2900,118 @@ void bwtInFiles(const std::string& sourceFile, size_t sourceLen, size_t maxAlpha
 
 	cerrMemoryUsage("before step 5");
 
-	step5InFile<IndexType>(fourthFile, fifthFile, maxMemory, std::get<2>(prep), std::get<0>(fourthRet), std::get<1>(fourthRet));
-
-	std::ofstream SAinverseWriter(SAinverseFile, std::ios::binary);
-	std::ifstream fifthReader(fifthFile, std::ios::binary);
-
-	cerrMemoryUsage("before step 6a");
-
-	alternateStep6a<IndexType>(SAinverseWriter, fifthReader, std::get<2>(prep));
-	SAinverseWriter.close();
-	fifthReader.close();
-
-	std::ifstream SAinverseReader(SAinverseFile, std::ios::binary);
-	std::ifstream LMSIndicesReader(LMSIndicesFile, std::ios::binary);
+	//the recursion gives the inverse suffix array of S' directly so step 6a is skipped
+	switch(symbolBytesFor(std::get<1>(fourthRet)))
+	{
+		case sizeof(unsigned char):
+			step5InFile<unsigned char>(fourthFile, SAinverseFile, maxMemory, std::get<2>(prep), std::get<0>(fourthRet), std::get<1>(fourthRet), sizeof(IndexType));
+			break;
+		case sizeof(uint16_t):
+			step5InFile<uint16_t>(fourthFile, SAinverseFile, maxMemory, std::get<2>(prep), std::get<0>(fourthRet), std::get<1>(fourthRet), sizeof(IndexType));
+			break;
+		case sizeof(uint32_t):
+			step5InFile<uint32_t>(fourthFile, SAinverseFile, maxMemory, std::get<2>(prep), std::get<0>(fourthRet), std::get<1>(fourthRet), sizeof(IndexType));
+			break;
+		default:
+			step5InFile<size_t>(fourthFile, SAinverseFile, maxMemory, std::get<2>(prep), std::get<0>(fourthRet), std::get<1>(fourthRet), sizeof(IndexType));
+			break;
+	}
 
-	cerrMemoryUsage("before step 6b");
+	{
+		FileStreambuffer SAinverseReaderBuf(SAinverseFile, FileStreambuffer::READ, streamBytes);
+		std::istream SAinverseReader(&SAinverseReaderBuf);
+		FileStreambuffer LMSIndicesReaderBuf(LMSIndicesFile, FileStreambuffer::READ, streamBytes);
+		std::istream LMSIndicesReader(&LMSIndicesReaderBuf);
+		FileStreambuffer sixthWriterBuf(sixthFile, FileStreambuffer::WRITE, streamBytes);
+		std::ostream sixthWriter(&sixthWriterBuf);
 
-	auto sixth = alternateStep6b<Alphabet, IndexType>(SAinverseReader, LMSIndicesReader, std::get<2>(prep));
-	SAinverseReader.close();
-	LMSIndicesReader.close();
+		cerrMemoryUsage("before step 6b");
 
-	writeVectorToFile(sixth, sixthFile);
-#ifndef NDEBUG
-#else
-	freeMemory(sixth);
-#endif
+		alternateStep6bLowMemory<IndexType>(SAinverseReader, LMSIndicesReader, std::get<2>(prep), maxMemory-std::min(maxMemory/2, streamMemory), sixthWriter);
+	}
 
-	source = readVectorFromFile<Alphabet>(sourceFile, addSentinel);
+	//mapped again, the pages which are still in the page cache aren't read from disk
+	sourceText.reset(new MappedText(sourceFile, addSentinel ? sizeof(Alphabet) : 0));
+	source = (const Alphabet*)sourceText->data();
+	sourceText->advise(MappedText::RANDOM);
+	sourceText->advise(MappedText::WILL_NEED);
 #ifndef NDEBUG
 	cerrMemoryUsage("before LMS suffix order verification");
 
-	verifyLMSSuffixesAreSorted(source.data(), sourceLen, sixth);
+	std::vector<IndexType> sixth = readVectorFromFile<IndexType>(sixthFile, false);
+	verifyLMSSuffixesAreSorted(source, sourceLen, sixth);
 	freeMemory(sixth);
 #endif
 
 	std::get<0>(prep) = readVectorFromFile<IndexType>(LCountFile, false);
 	std::get<1>(prep) = readVectorFromFile<IndexType>(charSumFile, false);
-
-	std::ofstream seventhWriter(seventhFile, std::ios::binary);
-	std::ifstream sixthReader(sixthFile, std::ios::binary);
+	//the types were dropped for step 5, computing them again from the text is cheaper than storing them
+	if (useTypes)
+	{
+		types = computeSuffixTypes(source, sourceLen, maxAlphabet, maxMemory/4);
+	}
 
 	cerrMemoryUsage("before step 7");
 
-	WeirdPriorityQueue<Alphabet, IndexType> result(sourceLen, maxMemory/2);
-
-	step2or7LowMemory<Alphabet, IndexType, true>(source.data(), sourceLen, maxAlphabet, maxMemory/2, seventhWriter, sixthReader, std::get<2>(prep), &result, std::get<1>(prep), std::get<0>(prep));
-	seventhWriter.close();
-	sixthReader.close();
+	//the final position of every symbol is known when it's induced, so they are written straight into the output through the bucket buffers
+	//for the recursion the final position is the rank of the suffix, those are collected in text order into another queue instead
+	std::unique_ptr<OutputFile> result;
+	std::unique_ptr<BucketWriter<Alphabet, IndexType>> resultBuckets;
+	std::unique_ptr<WeirdPriorityQueue<IndexType, IndexType>> ranks;
+	size_t inductionMemory = queueMemory;
+	if (ranksBytes == 0)
+	{
+		inductionMemory = queueMemory-queueMemory/4;
+		result.reset(new OutputFile(destFile, sourceLen*sizeof(Alphabet)));
+		resultBuckets.reset(new BucketWriter<Alphabet, IndexType>(*result, std::get<1>(prep), maxAlphabet, false, queueMemory-inductionMemory));
+	}
+	else
+	{
+		inductionMemory = queueMemory/2;
+		ranks.reset(new WeirdPriorityQueue<IndexType, IndexType>(sourceLen, queueMemory-inductionMemory));
+	}
 
-	std::ifstream seventhReader(seventhFile, std::ios::binary);
+	{
+		FileStreambuffer seventhWriterBuf(seventhFile, FileStreambuffer::WRITE, streamBytes);
+		std::ostream seventhWriter(&seventhWriterBuf);
+		FileStreambuffer sixthReaderBuf(sixthFile, FileStreambuffer::READ, streamBytes);
+		std::istream sixthReader(&sixthReaderBuf);
+		step2or7LowMemory<Alphabet, IndexType, true>(source, sourceLen, maxAlphabet, inductionMemory, seventhWriter, sixthReader, std::get<2>(prep), resultBuckets.get(), ranks.get(), std::get<1>(prep), std::get<0>(prep), useTypes ? &types : nullptr);
+	}
+	if (ranksBytes == 0)
+	{
+		resultBuckets->flush();
+		resultBuckets.reset(new BucketWriter<Alphabet, IndexType>(*result, std::get<1>(prep), maxAlphabet, true, queueMemory-inductionMemory));
+	}
 
 	cerrMemoryUsage("before step 8");
 
-	std::ofstream dummyStream;
-	step3or8LowMemory<Alphabet, IndexType, true>(source.data(), sourceLen, maxAlphabet, maxMemory/2, dummyStream, seventhReader, std::get<2>(prep), &result, std::get<1>(prep), std::get<0>(prep));
-	seventhReader.close();
+	{
+		FileStreambuffer seventhReaderBuf(seventhFile, FileStreambuffer::READ, streamBytes);
+		std::istream seventhReader(&seventhReaderBuf);
+		std::ofstream dummyStream;
+		step3or8LowMemory<Alphabet, IndexType, true>(source, sourceLen, maxAlphabet, inductionMemory, dummyStream, seventhReader, std::get<2>(prep), resultBuckets.get(), ranks.get(), std::get<1>(prep), std::get<0>(prep), useTypes ? &types : nullptr);
+	}
 
-	std::ofstream resultWriter(destFile, std::ios::binary);
-	while (!result.empty())
+	if (ranksBytes == 0)
+	{
+		resultBuckets->flush();
+		resultBuckets.reset();
+		result->close();
+	}
+	else
 	{
-		Alphabet alph = result.get();
-		resultWriter.write((char*)&alph, sizeof(Alphabet));
+		sourceText->close();
+		types = SuffixTypes();
+		FileStreambuffer ranksWriterBuf(destFile, FileStreambuffer::WRITE, streamBytes);
+		std::ostream ranksWriter(&ranksWriterBuf);
+		for (size_t i = 0; i < sourceLen; i++)
+		{
+			assert(!ranks->empty());
+			writeSymbol(ranksWriter, ranks->get(), ranksBytes);
+		}
+		assert(ranks->empty());
 	}
-	resultWriter.close();
 
 	remove(LMSLeftFile.c_str());
 	remove(charSumFile.c_str());
@@ -1425,7 +3020,6 @@ void bwtInFiles(const std::string& sourceFile, size_t sourceLen, size_t maxAlpha
 	remove(secondFile.c_str());
 	remove(thirdFile.c_str());
 	remove(fourthFile.c_str());
-	remove(fifthFile.c_str());
 	remove(SAinverseFile.c_str());
 	remove(sixthFile.c_str());
 	remove(seventhFile.c_str());
@@ -1434,23 +3028,23 @@ void bwtInFiles(const std::string& sourceFile, size_t sourceLen, size_t maxAlpha
 }
 
 template <class Alphabet>
-void bwtInFiles(const std::string& sourceFile, size_t sourceLen, size_t maxAlphabet, size_t maxMemory, const std::string& destFile, bool addSentinel)
+void bwtInFiles(const std::string& sourceFile, size_t sourceLen, size_t maxAlphabet, size_t maxMemory, const std::string& destFile, bool addSentinel, size_t ranksBytes)
 {
 	if (sourceLen < 255)
 	{
-		bwtInFiles<Alphabet, unsigned char>(sourceFile, sourceLen, maxAlphabet, maxMemory, destFile, addSentinel);
+		bwtInFiles<Alphabet, unsigned char>(sourceFile, sourceLen, maxAlphabet, maxMemory, destFile, addSentinel, ranksBytes);
 	}
 	else if (sourceLen < std::numeric_limits<uint16_t>::max())
 	{
-		bwtInFiles<Alphabet, uint16_t>(sourceFile, sourceLen, maxAlphabet, maxMemory, destFile, addSentinel);
+		bwtInFiles<Alphabet, uint16_t>(sourceFile, sourceLen, maxAlphabet, maxMemory, destFile, addSentinel, ranksBytes);
 	}
 	else if (sourceLen < std::numeric_limits<uint32_t>::max())
 	{
-		bwtInFiles<Alphabet, uint32_t>(sourceFile, sourceLen, maxAlphabet, maxMemory, destFile, addSentinel);
+		bwtInFiles<Alphabet, uint32_t>(sourceFile, sourceLen, maxAlphabet, maxMemory, destFile, addSentinel, ranksBytes);
 	}
 	else
 	{
-		bwtInFiles<Alphabet, size_t>(sourceFile, sourceLen, maxAlphabet, maxMemory, destFile, addSentinel);
+		bwtInFiles<Alphabet, size_t>(sourceFile, sourceLen, maxAlphabet, maxMemory, destFile, addSentinel, ranksBytes);
 	}
 }
 
@@ -1461,25 +3055,203 @@ void bwtInFiles(const std::string& sourceFile, size_t maxAlphabet, size_t maxMem
 	bwtInFiles<Alphabet>(sourceFile, sourceLen, maxAlphabet, maxMemory, destFile, true);
 }
 
-template <class Alphabet, class IndexType>
-void inverseBWT(const Alphabet* source, size_t sourceLen, size_t maxAlphabet, Alphabet* dest)
+//the inverse BWT is done in segments from this length on, with this many segments per thread so the uneven segments even out
+//every thread walks this many segments at once so the cache misses of the walks overlap
+const size_t minSegmentedInverse = (size_t)1 << 20;
+const size_t inverseSegmentsPerThread = 64;
+const size_t inverseWalksAtOnce = 16;
+
+//LF mapping of every row of the BWT, or with inverted its inverse psi, and the row of the sentinel
+//the pieces of the BWT are mapped in parallel from the counts of the symbols before them, unless merging the counts of a big alphabet costs more
+template <class Alphabet, class IndexType, bool inverted>
+std::vector<IndexType> LFMapping(const Alphabet* source, size_t sourceLen, size_t maxAlphabet, size_t& sentinelRow)
 {
 	auto charSum = charSums(source, sourceLen, maxAlphabet);
-	std::vector<IndexType> usedCharacters(maxAlphabet+1, 0);
+	size_t threads = getNumThreads();
+	size_t pieces = threads > 1 && sourceLen >= minSegmentedInverse && 16*threads*(maxAlphabet+1) <= sourceLen ? threads : 1;
+	size_t pieceLen = (sourceLen+pieces-1)/pieces;
+	std::vector<std::vector<IndexType>> before(pieces, std::vector<IndexType>(maxAlphabet+1, 0));
+	parallelFor(pieces-1, [&](size_t piece)
+	{
+		for (size_t i = piece*pieceLen; i < std::min(sourceLen, (piece+1)*pieceLen); i++)
+		{
+			assert(source[i] < maxAlphabet+1);
+			before[piece+1][source[i]]++;
+		}
+	});
+	for (size_t a = 0; a < maxAlphabet+1; a++)
+	{
+		before[0][a] = charSum[a];
+		for (size_t piece = 1; piece < pieces; piece++)
+		{
+			before[piece][a] += before[piece-1][a];
+		}
+	}
 	std::vector<IndexType> LFmapping(sourceLen, 0);
-	IndexType index = 0;
-	for (size_t i = 0; i < sourceLen; i++)
+	std::vector<size_t> sentinels(pieces, sourceLen);
+	parallelFor(pieces, [&](size_t piece)
+	{
+		std::vector<IndexType>& used = before[piece];
+		for (size_t i = piece*pieceLen; i < std::min(sourceLen, (piece+1)*pieceLen); i++)
+		{
+			assert(source[i] < maxAlphabet+1);
+			assert(used[source[i]] < charSum[source[i]+1]);
+			if (inverted)
+			{
+				LFmapping[used[source[i]]++] = i;
+			}
+			else
+			{
+				LFmapping[i] = used[source[i]]++;
+			}
+			if (source[i] == 0)
+			{
+				assert(sentinels[piece] == sourceLen);
+				sentinels[piece] = i;
+			}
+		}
+	});
+	sentinelRow = *std::min_element(sentinels.begin(), sentinels.end());
+	assert(sentinelRow < sourceLen);
+	return LFmapping;
+}
+
+//the symbol of every row of the BWT is the first symbol of its suffix, which is found from the bucket the row is in
+//a table of every chunk's first symbol leaves only the few buckets within the chunk to check
+template <class Alphabet>
+class RowSymbols
+{
+public:
+	RowSymbols(const std::vector<size_t>& charSum, size_t numRows) :
+		charSum(charSum),
+		chunkBits(0),
+		firstSymbol()
+	{
+		while ((numRows >> chunkBits) > 4096)
+		{
+			chunkBits++;
+		}
+		firstSymbol.resize((numRows >> chunkBits)+1);
+		size_t symbol = 0;
+		for (size_t chunk = 0; chunk < firstSymbol.size(); chunk++)
+		{
+			while (charSum[symbol+1] <= chunk << chunkBits && symbol+2 < charSum.size())
+			{
+				symbol++;
+			}
+			firstSymbol[chunk] = symbol;
+		}
+	};
+	Alphabet symbolOf(size_t row) const
+	{
+		size_t symbol = firstSymbol[row >> chunkBits];
+		while (charSum[symbol+1] <= row)
+		{
+			symbol++;
+		}
+		return symbol;
+	};
+private:
+	const std::vector<size_t>& charSum;
+	size_t chunkBits;
+	std::vector<size_t> firstSymbol;
+};
+
+//walking LF from the sentinel is one dependent cache miss per symbol plus another for the symbol, so long texts are decoded in segments
+//the segments start at evenly spaced rows and at the sentinel's row, and each one is walked into its own buffer until the next start row
+//the walks follow psi, so the text comes out forwards, and take the symbols from the rows' buckets, so only psi is read at random
+//every thread walks several segments in turn and prefetches their next rows, so one walk's cache miss is hidden behind the others' steps
+//psi is a single cycle, so following the segments from the sentinel's one gives where they are in the text
+template <class Alphabet, class IndexType>
+void inverseBWTInSegments(const Alphabet* source, size_t sourceLen, size_t maxAlphabet, Alphabet* dest, size_t numSegments)
+{
+	size_t sentinelRow;
+	std::vector<IndexType> psi = LFMapping<Alphabet, IndexType, true>(source, sourceLen, maxAlphabet, sentinelRow);
+	std::vector<size_t> charSum = charSums(source, sourceLen, maxAlphabet);
+	RowSymbols<Alphabet> symbols(charSum, sourceLen);
+	numSegments = std::max((size_t)1, std::min(numSegments, sourceLen));
+	std::vector<size_t> starts;
+	for (size_t i = 0; i < numSegments; i++)
+	{
+		starts.push_back(i*sourceLen/numSegments);
+	}
+	if (!std::binary_search(starts.begin(), starts.end(), sentinelRow))
+	{
+		starts.insert(std::upper_bound(starts.begin(), starts.end(), sentinelRow), sentinelRow);
+	}
+	std::vector<uint64_t> isStart((sourceLen+63)/64, 0);
+	for (size_t i = 0; i < starts.size(); i++)
+	{
+		isStart[starts[i]/64] |= (uint64_t)1 << (starts[i]%64);
+	}
+	std::vector<std::vector<Alphabet>> decoded(starts.size());
+	std::vector<size_t> nextSegment(starts.size());
+	size_t numGroups = (starts.size()+inverseWalksAtOnce-1)/inverseWalksAtOnce;
+	parallelFor(numGroups, [&](size_t group)
 	{
-		assert(source[i] < maxAlphabet+1);
-		assert(charSum[source[i]] < std::numeric_limits<IndexType>::max()-usedCharacters[source[i]]);
-		LFmapping[i] = charSum[source[i]]+usedCharacters[source[i]];
-		usedCharacters[source[i]]++;
-		if (source[i] == 0)
+		size_t end = std::min(starts.size(), (group+1)*inverseWalksAtOnce);
+		size_t numWalks = end-group*inverseWalksAtOnce;
+		size_t segment[inverseWalksAtOnce];
+		size_t row[inverseWalksAtOnce];
+		for (size_t walk = 0; walk < numWalks; walk++)
+		{
+			segment[walk] = group*inverseWalksAtOnce+walk;
+			row[walk] = starts[segment[walk]];
+		}
+		while (numWalks > 0)
 		{
-			assert(index == 0);
-			index = i;
+			size_t walk = 0;
+			while (walk < numWalks)
+			{
+				decoded[segment[walk]].push_back(symbols.symbolOf(row[walk]));
+				row[walk] = psi[row[walk]];
+				if ((isStart[row[walk]/64] >> (row[walk]%64)) & 1)
+				{
+					//a finished walk is replaced by the last one
+					nextSegment[segment[walk]] = std::lower_bound(starts.begin(), starts.end(), row[walk])-starts.begin();
+					numWalks--;
+					segment[walk] = segment[numWalks];
+					row[walk] = row[numWalks];
+				}
+				else
+				{
+					__builtin_prefetch(psi.data()+row[walk]);
+					walk++;
+				}
+			}
 		}
+	});
+	freeMemory(psi);
+	//the sentinel's row is the row of the whole text, so its segment starts the text
+	std::vector<size_t> offset(starts.size());
+	size_t segment = std::lower_bound(starts.begin(), starts.end(), sentinelRow)-starts.begin();
+	size_t start = 0;
+	for (size_t i = 0; i < starts.size(); i++)
+	{
+		offset[segment] = start;
+		start += decoded[segment].size();
+		segment = nextSegment[segment];
+	}
+	assert(start == sourceLen);
+	assert(starts[segment] == sentinelRow);
+	parallelFor(starts.size(), [&](size_t segment)
+	{
+		std::copy(decoded[segment].begin(), decoded[segment].end(), dest+offset[segment]);
+		freeMemory(decoded[segment]);
+	});
+}
+
+template <class Alphabet, class IndexType>
+void inverseBWT(const Alphabet* source, size_t sourceLen, size_t maxAlphabet, Alphabet* dest)
+{
+	if (sourceLen >= minSegmentedInverse)
+	{
+		inverseBWTInSegments<Alphabet, IndexType>(source, sourceLen, maxAlphabet, dest, getNumThreads()*inverseSegmentsPerThread);
+		return;
 	}
+	size_t sentinelRow;
+	std::vector<IndexType> LFmapping = LFMapping<Alphabet, IndexType, false>(source, sourceLen, maxAlphabet, sentinelRow);
+	IndexType index = sentinelRow;
 	IndexType loc = sourceLen-1;
 	do
 	{
@@ -1512,4 +3284,397 @@ void inverseBWT(const Alphabet* source, size_t sourceLen, size_t maxAlphabet, Al
 	}
 }
 
+//arrays written for mapping back into memory are padded to 8 bytes so the next one stays aligned
+inline size_t paddedBytes(size_t bytes)
+{
+	return (bytes+7)/8*8;
+}
+
+template <class T>
+void writePadded(std::ostream& out, const T* data, size_t count)
+{
+	const char padding[8] = { 0 };
+	out.write((const char*)data, count*sizeof(T));
+	out.write(padding, paddedBytes(count*sizeof(T))-count*sizeof(T));
+}
+
+//the number of times a symbol of the BWT appears before it, from counts sampled at every superblock and every block
+//the symbols which appear get dense codes so the samples take little space, and the counts within a block are counted from the text
+//blocks are as short as maxBytes allows, block counts are relative to the superblock so they fit in 16 bits
+//the samples can be written into a file and used from a mapping of it without building them again
+template <class Alphabet, class IndexType>
+class SampledRanks
+{
+public:
+	static const size_t superblockBits = 16;
+	SampledRanks(const Alphabet* text, size_t textLen, size_t maxAlphabet, size_t maxBytes) :
+		text(text),
+		textLen(textLen),
+		numCodes(0),
+		blockBits(6),
+		ownCode(maxAlphabet+1, 0),
+		ownSuperblockCounts(),
+		ownBlockCounts()
+	{
+		std::vector<size_t> counts = countSymbols(text, textLen, maxAlphabet);
+		for (size_t i = 0; i < maxAlphabet+1; i++)
+		{
+			if (counts[i] > 0)
+			{
+				ownCode[i] = numCodes++;
+			}
+		}
+		while (blockBits < superblockBits && bytesFor(textLen, numCodes, blockBits) > maxBytes)
+		{
+			blockBits++;
+		}
+		ownSuperblockCounts.resize(numSuperblocks()*numCodes, 0);
+		ownBlockCounts.resize(numBlocks()*numCodes, 0);
+		std::vector<IndexType> running(numCodes, 0);
+		size_t blockLen = (size_t)1 << blockBits;
+		for (size_t blockStart = 0; blockStart < textLen; blockStart += blockLen)
+		{
+			size_t superblock = blockStart >> superblockBits;
+			if ((blockStart & (((size_t)1 << superblockBits)-1)) == 0)
+			{
+				std::copy(running.begin(), running.end(), ownSuperblockCounts.begin()+superblock*numCodes);
+			}
+			for (size_t c = 0; c < numCodes; c++)
+			{
+				ownBlockCounts[(blockStart >> blockBits)*numCodes+c] = running[c]-ownSuperblockCounts[superblock*numCodes+c];
+			}
+			for (size_t i = blockStart; i < std::min(textLen, blockStart+blockLen); i++)
+			{
+				running[ownCode[text[i]]]++;
+			}
+		}
+		codeCount = ownCode.size();
+		code = ownCode.data();
+		superblockCounts = ownSuperblockCounts.data();
+		blockCounts = ownBlockCounts.data();
+	};
+	//uses samples written by write for the same text, which must stay in memory as long as this
+	SampledRanks(const Alphabet* text, const char* written) :
+		text(text),
+		ownCode(),
+		ownSuperblockCounts(),
+		ownBlockCounts()
+	{
+		const uint64_t* header = (const uint64_t*)written;
+		textLen = header[0];
+		numCodes = header[1];
+		blockBits = header[2];
+		codeCount = header[3];
+		written += headerBytes;
+		code = (const size_t*)written;
+		written += paddedBytes(codeCount*sizeof(size_t));
+		superblockCounts = (const IndexType*)written;
+		written += paddedBytes(numSuperblocks()*numCodes*sizeof(IndexType));
+		blockCounts = (const uint16_t*)written;
+	};
+	SampledRanks(const SampledRanks& second) = delete;
+	SampledRanks& operator=(const SampledRanks& second) = delete;
+	//whether the writtenBytes bytes at written hold samples which write wrote for a text of textLen symbols with codeCount codes
+	static bool isWritten(const char* written, size_t writtenBytes, size_t textLen, size_t codeCount)
+	{
+		if (writtenBytes < headerBytes)
+		{
+			return false;
+		}
+		const uint64_t* header = (const uint64_t*)written;
+		size_t numCodes = header[1];
+		size_t blockBits = header[2];
+		if (header[0] != textLen || header[3] != codeCount || numCodes > codeCount || blockBits < 6 || blockBits > superblockBits || codeCount > (writtenBytes-headerBytes)/sizeof(size_t))
+		{
+			return false;
+		}
+		const size_t* code = (const size_t*)(written+headerBytes);
+		for (size_t i = 0; i < codeCount; i++)
+		{
+			if (code[i] >= std::max(numCodes, (size_t)1))
+			{
+				return false;
+			}
+		}
+		size_t remaining = writtenBytes-headerBytes-paddedBytes(codeCount*sizeof(size_t));
+		size_t superblockCountsLen = ((textLen >> superblockBits)+1)*numCodes;
+		if (numCodes > remaining/sizeof(IndexType)/((textLen >> superblockBits)+1) || paddedBytes(superblockCountsLen*sizeof(IndexType)) > remaining)
+		{
+			return false;
+		}
+		remaining -= paddedBytes(superblockCountsLen*sizeof(IndexType));
+		return numCodes <= remaining/sizeof(uint16_t)/((textLen >> blockBits)+1) && paddedBytes(((textLen >> blockBits)+1)*numCodes*sizeof(uint16_t)) <= remaining;
+	};
+	static size_t bytesFor(size_t textLen, size_t numCodes, size_t blockBits)
+	{
+		return ((textLen >> blockBits)+1)*numCodes*sizeof(uint16_t)+((textLen >> superblockBits)+1)*numCodes*sizeof(IndexType);
+	};
+	void write(std::ostream& out) const
+	{
+		uint64_t header[4] = { textLen, numCodes, blockBits, codeCount };
+		out.write((const char*)header, sizeof(header));
+		writePadded(out, code, codeCount);
+		writePadded(out, superblockCounts, numSuperblocks()*numCodes);
+		writePadded(out, blockCounts, numBlocks()*numCodes);
+	};
+	size_t rank(size_t index) const
+	{
+		Alphabet symbol = text[index];
+		size_t c = code[symbol];
+		size_t ret = superblockCounts[(index >> superblockBits)*numCodes+c]+blockCounts[(index >> blockBits)*numCodes+c];
+		for (size_t i = index >> blockBits << blockBits; i < index; i++)
+		{
+			ret += text[i] == symbol;
+		}
+		return ret;
+	};
+private:
+	static const size_t headerBytes = 4*sizeof(uint64_t);
+	size_t numSuperblocks() const { return (textLen >> superblockBits)+1; };
+	size_t numBlocks() const { return (textLen >> blockBits)+1; };
+	const Alphabet* text;
+	size_t textLen;
+	size_t numCodes;
+	size_t blockBits;
+	size_t codeCount;
+	std::vector<size_t> ownCode;
+	std::vector<IndexType> ownSuperblockCounts;
+	std::vector<uint16_t> ownBlockCounts;
+	const size_t* code;
+	const IndexType* superblockCounts;
+	const uint16_t* blockCounts;
+};
+
+//inverse BWT which keeps only the BWT and maxMemory bytes in memory
+//LF is computed from sampled ranks instead of a mapping of every row, the text is decoded backwards into a buffer which is written out whenever it's full
+template <class Alphabet, class IndexType>
+void inverseBWTInFiles(const std::string& sourceFile, size_t maxAlphabet, size_t maxMemory, const std::string& destFile)
+{
+	std::vector<Alphabet> source = readVectorFromFile<Alphabet>(sourceFile, false);
+	size_t sourceLen = source.size();
+	if (sourceLen == 0)
+	{
+		writeVectorToFile(source, destFile);
+		return;
+	}
+	size_t bufferLen = std::min(sourceLen, std::max((size_t)1 << 12, std::min(maxMemory/8, (size_t)1 << 24))/sizeof(Alphabet));
+	size_t rankBytes = maxMemory-std::min(maxMemory, bufferLen*sizeof(Alphabet));
+	SampledRanks<Alphabet, IndexType> ranks(source.data(), sourceLen, maxAlphabet, rankBytes);
+	auto charSum = charSums(source.data(), sourceLen, maxAlphabet);
+	size_t index = std::find(source.begin(), source.end(), 0)-source.begin();
+	assert(index < sourceLen);
+	std::vector<Alphabet> buffer(bufferLen);
+	std::ofstream out(destFile, std::ios::binary);
+	for (size_t end = sourceLen; end > 0;)
+	{
+		size_t start = end-std::min(end, bufferLen);
+		for (size_t loc = end; loc > start; loc--)
+		{
+			buffer[loc-1-start] = source[index];
+			index = charSum[source[index]]+ranks.rank(index);
+		}
+		out.seekp(start*sizeof(Alphabet));
+		out.write((const char*)buffer.data(), (end-start)*sizeof(Alphabet));
+		end = start;
+	}
+	assert(source[index] == 0);
+}
+
+template <class Alphabet>
+void inverseBWTInFiles(const std::string& sourceFile, size_t maxAlphabet, size_t maxMemory, const std::string& destFile)
+{
+	size_t sourceLen = getFileLengthInAlphabets<Alphabet>(sourceFile);
+	if (sourceLen < std::numeric_limits<uint32_t>::max())
+	{
+		inverseBWTInFiles<Alphabet, uint32_t>(sourceFile, maxAlphabet, maxMemory, destFile);
+	}
+	else
+	{
+		inverseBWTInFiles<Alphabet, size_t>(sourceFile, maxAlphabet, maxMemory, destFile);
+	}
+}
+
+//extracts any range of the text from its BWT without inverting all of it
+//the rows of every sampleRate:th suffix are found by walking the whole BWT once, and a range is decoded backwards from the first sample after it
+//LF is computed from sampled ranks, and the samples, ranks and symbol counts are written into an index file which is used through a mapping,
+//so an extraction only reads the pages of the BWT and the index which its walk needs
+template <class Alphabet, class IndexType>
+class ExtractionIndex
+{
+public:
+	ExtractionIndex(const Alphabet* bwt, size_t bwtLen, size_t maxAlphabet, size_t rankBytes, size_t sampleRate) :
+		bwt(bwt),
+		bwtLen(bwtLen),
+		sampleRate(sampleRate),
+		ownCharSum(charSums(bwt, bwtLen, maxAlphabet)),
+		ownSampleRows((bwtLen+sampleRate-1)/sampleRate),
+		charSum(ownCharSum.data()),
+		charSumCount(ownCharSum.size()),
+		sampleRows(ownSampleRows.data()),
+		ranks(bwt, bwtLen, maxAlphabet, rankBytes)
+	{
+		assert(sampleRate > 0);
+		//the row of suffix 0 is where the sentinel is in the BWT, stepping back from suffix i+1 gives suffix i
+		size_t row = std::find(bwt, bwt+bwtLen, 0)-bwt;
+		assert(row < bwtLen);
+		ownSampleRows[0] = row;
+		for (size_t suffix = bwtLen-1; suffix > 0; suffix--)
+		{
+			row = LF(row);
+			if (suffix % sampleRate == 0)
+			{
+				ownSampleRows[suffix/sampleRate] = row;
+			}
+		}
+	};
+	//uses an index written by write for the same BWT, which must stay in memory as long as this
+	//check the index with isWritten first, this only asserts it
+	ExtractionIndex(const Alphabet* bwt, size_t bwtLen, const char* written) :
+		bwt(bwt),
+		bwtLen(bwtLen),
+		sampleRate(((const uint64_t*)written)[0]),
+		ownCharSum(),
+		ownSampleRows(),
+		charSum((const size_t*)(written+headerBytes)),
+		charSumCount(((const uint64_t*)written)[2]),
+		sampleRows((const IndexType*)(written+headerBytes+paddedBytes(charSumCount*sizeof(size_t)))),
+		ranks(bwt, written+headerBytes+paddedBytes(charSumCount*sizeof(size_t))+paddedBytes(numSamples()*sizeof(IndexType)))
+	{
+		assert(((const uint64_t*)written)[1] == bwtLen);
+	};
+	ExtractionIndex(const ExtractionIndex& second) = delete;
+	ExtractionIndex& operator=(const ExtractionIndex& second) = delete;
+	//whether the writtenBytes bytes at written hold an index which write wrote for a BWT of bwtLen symbols
+	//only the header and the lengths of the arrays are checked, not the samples themselves
+	static bool isWritten(const char* written, size_t writtenBytes, size_t bwtLen)
+	{
+		if (writtenBytes < headerBytes)
+		{
+			return false;
+		}
+		const uint64_t* header = (const uint64_t*)written;
+		size_t sampleRate = header[0];
+		size_t charSumCount = header[2];
+		if (sampleRate == 0 || header[1] != bwtLen || charSumCount == 0 || charSumCount > (writtenBytes-headerBytes)/sizeof(size_t))
+		{
+			return false;
+		}
+		size_t samplesStart = headerBytes+paddedBytes(charSumCount*sizeof(size_t));
+		size_t samplesBytes = paddedBytes((bwtLen/sampleRate+(bwtLen % sampleRate != 0))*sizeof(IndexType));
+		if (samplesStart > writtenBytes || samplesBytes > writtenBytes-samplesStart)
+		{
+			return false;
+		}
+		//the symbol counts have one more entry than the ranks have codes
+		return SampledRanks<Alphabet, IndexType>::isWritten(written+samplesStart+samplesBytes, writtenBytes-samplesStart-samplesBytes, bwtLen, charSumCount-1);
+	};
+	void write(std::ostream& out) const
+	{
+		uint64_t header[headerBytes/sizeof(uint64_t)] = { sampleRate, bwtLen, charSumCount };
+		out.write((const char*)header, sizeof(header));
+		writePadded(out, charSum, charSumCount);
+		writePadded(out, sampleRows, numSamples());
+		ranks.write(out);
+	};
+	//the length of the text without the sentinel
+	size_t textLength() const { return bwtLen-1; };
+	//the text in [from, to)
+	std::vector<Alphabet> extract(size_t from, size_t to) const
+	{
+		assert(from <= to && to <= textLength());
+		std::vector<Alphabet> ret(to-from);
+		if (from == to)
+		{
+			return ret;
+		}
+		//the sentinel's suffix isn't sampled but it's always the first row
+		size_t suffix = (to+sampleRate-1)/sampleRate*sampleRate;
+		size_t row = 0;
+		if (suffix < bwtLen)
+		{
+			row = sampleRows[suffix/sampleRate];
+		}
+		else
+		{
+			suffix = bwtLen-1;
+		}
+		for (; suffix > to; suffix--)
+		{
+			row = LF(row);
+		}
+		for (; suffix > from; suffix--)
+		{
+			ret[suffix-1-from] = bwt[row];
+			row = LF(row);
+		}
+		return ret;
+	};
+private:
+	static const size_t headerBytes = 3*sizeof(uint64_t);
+	size_t numSamples() const { return (bwtLen+sampleRate-1)/sampleRate; };
+	size_t LF(size_t row) const
+	{
+		return charSum[bwt[row]]+ranks.rank(row);
+	};
+	const Alphabet* bwt;
+	size_t bwtLen;
+	size_t sampleRate;
+	std::vector<size_t> ownCharSum;
+	std::vector<IndexType> ownSampleRows;
+	const size_t* charSum;
+	size_t charSumCount;
+	const IndexType* sampleRows;
+	SampledRanks<Alphabet, IndexType> ranks;
+};
+
+template <class Alphabet, class IndexType>
+void buildExtractionIndex(const std::string& bwtFile, size_t maxAlphabet, size_t maxMemory, size_t sampleRate, const std::string& indexFile)
+{
+	MappedFile bwtMapping(bwtFile);
+	ExtractionIndex<Alphabet, IndexType> index((const Alphabet*)bwtMapping.data(), bwtMapping.size()/sizeof(Alphabet), maxAlphabet, maxMemory, sampleRate);
+	std::ofstream out(indexFile, std::ios::binary);
+	index.write(out);
+}
+
+//returns false if the index file isn't an index of the BWT
+template <class Alphabet, class IndexType>
+bool extractFromBWT(const std::string& bwtFile, const std::string& indexFile, size_t from, size_t to, std::vector<Alphabet>& result)
+{
+	MappedFile bwtMapping(bwtFile);
+	MappedFile indexMapping(indexFile);
+	size_t bwtLen = bwtMapping.size()/sizeof(Alphabet);
+	if (!ExtractionIndex<Alphabet, IndexType>::isWritten(indexMapping.data(), indexMapping.size(), bwtLen))
+	{
+		std::cerr << "file " << indexFile << " is not an extraction index of BWT " << bwtFile << "\n";
+		return false;
+	}
+	ExtractionIndex<Alphabet, IndexType> index((const Alphabet*)bwtMapping.data(), bwtLen, indexMapping.data());
+	result = index.extract(from, to);
+	return true;
+}
+
+//the samples are stored with 32-bit rows whenever the BWT is short enough
+template <class Alphabet>
+void buildExtractionIndex(const std::string& bwtFile, size_t maxAlphabet, size_t maxMemory, size_t sampleRate, const std::string& indexFile)
+{
+	if (getFileLengthInAlphabets<Alphabet>(bwtFile) < std::numeric_limits<uint32_t>::max())
+	{
+		buildExtractionIndex<Alphabet, uint32_t>(bwtFile, maxAlphabet, maxMemory, sampleRate, indexFile);
+	}
+	else
+	{
+		buildExtractionIndex<Alphabet, size_t>(bwtFile, maxAlphabet, maxMemory, sampleRate, indexFile);
+	}
+}
+
+template <class Alphabet>
+bool extractFromBWT(const std::string& bwtFile, const std::string& indexFile, size_t from, size_t to, std::vector<Alphabet>& result)
+{
+	if (getFileLengthInAlphabets<Alphabet>(bwtFile) < std::numeric_limits<uint32_t>::max())
+	{
+		return extractFromBWT<Alphabet, uint32_t>(bwtFile, indexFile, from, to, result);
+	}
+	return extractFromBWT<Alphabet, size_t>(bwtFile, indexFile, from, to, result);
+}
+
 #endif
\ No newline at end of file
@@ -2,6 +2,7 @@
 #include <algorithm>
 #include <cstring>
 #include <fstream>
+#include <sstream>
 #include <unistd.h>
 
 #include "bwt.h"
@@ -245,6 +246,93 @@ void testReversibilityWithLotsOfRandoms(int iterations, size_t size)
 	delete [] result;
 }
 
+void testInverseInSegmentsWithLotsOfRandoms(int iterations, size_t size, size_t numSegments)
+{
+	std::cerr << "Testing inverse BWT in " << numSegments << " segments with " << iterations << " random strings with length " << size << "\n";
+	std::vector<unsigned char> string(size, 0);
+	std::vector<unsigned char> transformed(size, 0);
+	std::vector<unsigned char> result(size, 0);
+	for (int iteration = 0; iteration < iterations; iteration++)
+	{
+		for (size_t i = 0; i < size-1; i++)
+		{
+			string[i] = (rand() % 4)+1; //anything except \0
+		}
+		string[size-1] = '\0';
+		bwt(string.data(), size, 255, transformed.data());
+		inverseBWTInSegments<unsigned char, uint32_t>(transformed.data(), size, 255, result.data(), numSegments);
+		if (string != result)
+		{
+			std::cerr << "inverse BWT in segments of a random string not equal to the string\n";
+			throw 1;
+		}
+	}
+}
+
+void testExtractionWithLotsOfRandoms(int iterations, size_t size, size_t sampleRate, size_t rankBytes)
+{
+	std::cerr << "Testing extraction with sample rate " << sampleRate << " from " << iterations << " random strings with length " << size << "\n";
+	std::vector<unsigned char> string(size, 0);
+	std::vector<unsigned char> transformed(size, 0);
+	for (int iteration = 0; iteration < iterations; iteration++)
+	{
+		for (size_t i = 0; i < size-1; i++)
+		{
+			string[i] = (rand() % 4)+1; //anything except \0
+		}
+		string[size-1] = '\0';
+		bwt(string.data(), size, 255, transformed.data());
+		std::ostringstream written;
+		ExtractionIndex<unsigned char, uint32_t>(transformed.data(), size, 255, rankBytes, sampleRate).write(written);
+		std::string writtenIndex = written.str();
+		if (!ExtractionIndex<unsigned char, uint32_t>::isWritten(writtenIndex.data(), writtenIndex.size(), size) || ExtractionIndex<unsigned char, uint32_t>::isWritten(writtenIndex.data(), writtenIndex.size()-1, size))
+		{
+			std::cerr << "written extraction index not recognized, or recognized when truncated\n";
+			throw 1;
+		}
+		ExtractionIndex<unsigned char, uint32_t> index(transformed.data(), size, writtenIndex.data());
+		for (int range = 0; range < 20; range++)
+		{
+			size_t from = rand() % size;
+			size_t to = from+rand() % (size-from);
+			if (range == 0)
+			{
+				from = 0;
+				to = size-1;
+			}
+			std::vector<unsigned char> extracted = index.extract(from, to);
+			if (!std::equal(extracted.begin(), extracted.end(), string.begin()+from) || extracted.size() != to-from)
+			{
+				std::cerr << "extracted range [" << from << ", " << to << ") NOT equal to the string\n";
+				throw 1;
+			}
+		}
+	}
+}
+
+void testLeanBWTWithLotsOfRandoms(int iterations, size_t size, int alphabetSize)
+{
+	std::cerr << "Testing lean BWT against BWT with " << iterations << " random strings with length " << size << " and alphabet size " << alphabetSize << "\n";
+	std::vector<unsigned char> string(size, 0);
+	std::vector<unsigned char> expected(size, 0);
+	std::vector<unsigned char> result(size, 0);
+	for (int iteration = 0; iteration < iterations; iteration++)
+	{
+		for (size_t i = 0; i < size-1; i++)
+		{
+			string[i] = (rand() % alphabetSize)+1; //anything except \0
+		}
+		string[size-1] = '\0';
+		bwt(string.data(), size, 255, expected.data());
+		bwtLean(string.data(), size, 255, result.data());
+		if (expected != result)
+		{
+			std::cerr << "lean BWT of a random string not equal to BWT\n";
+			throw 1;
+		}
+	}
+}
+
 // big broken string was found by testReversibilityWithLotsOfRandoms and used to break the algorithm
 void testReversibilityWithBigBroken()
 {
@@ -280,6 +368,126 @@ void testReversibilityWithFile(const char* fileName)
 	delete [] source;
 }
 
+void testBWTInFilesWithLotsOfRandoms(int iterations, size_t size, size_t maxMemory, size_t maxOpenTempFiles)
+{
+	std::cerr << "Testing BWT in files using " << maxMemory << " bytes and " << maxOpenTempFiles << " open temp files with " << iterations << " random strings with length " << size << "\n";
+	setMaxOpenTempFiles(maxOpenTempFiles);
+	std::vector<unsigned char> string(size, 0);
+	std::vector<unsigned char> expected(size, 0);
+	std::string sourceFile = getTempFileName();
+	std::string resultFile = getTempFileName();
+	for (int iteration = 0; iteration < iterations; iteration++)
+	{
+		for (size_t i = 0; i < size-1; i++)
+		{
+			string[i] = (rand() % 4)+1; //anything except \0
+		}
+		string[size-1] = '\0';
+		bwt(string.data(), size, 255, expected.data());
+		//the in-files BWT adds the sentinel itself
+		writeVectorToFile(std::vector<unsigned char>(string.begin(), string.end()-1), sourceFile);
+		bwtInFiles<unsigned char>(sourceFile, 255, maxMemory, resultFile);
+		if (readVectorFromFile<unsigned char>(resultFile, false) != expected)
+		{
+			std::cerr << "BWT in files of a random string NOT equal to BWT\n";
+			throw 1;
+		}
+	}
+	remove(sourceFile.c_str());
+	remove(resultFile.c_str());
+	setMaxOpenTempFiles(defaultMaxOpenTempFiles);
+}
+
+//the items are inserted either in random order, so the spilled blocks' priorities are stored with fixed width,
+//or in increasing order, so the small differences are delta+varint coded
+//while getting, more items are inserted after the position, some of them into the current window
+void testPriorityQueueWithLotsOfRandoms(size_t maxPriority, size_t maxBytes, bool increasing)
+{
+	std::cerr << "Testing priority queue using " << maxBytes << " bytes with " << maxPriority << " priorities inserted in " << (increasing ? "increasing" : "random") << " order\n";
+	WeirdPriorityQueue<uint32_t, uint32_t> queue(maxPriority, maxBytes);
+	std::vector<bool> present(maxPriority, false);
+	std::vector<uint32_t> priorities;
+	for (size_t i = 0; i < maxPriority; i++)
+	{
+		if (rand() % 4 != 0)
+		{
+			priorities.push_back(i);
+		}
+	}
+	if (!increasing)
+	{
+		for (size_t i = priorities.size(); i > 1; i--)
+		{
+			std::swap(priorities[i-1], priorities[rand() % i]);
+		}
+	}
+	for (size_t i = 0; i < priorities.size(); i++)
+	{
+		queue.insert(priorities[i]*7+3, priorities[i]);
+		present[priorities[i]] = true;
+	}
+	size_t position = 0;
+	while (!queue.empty())
+	{
+		uint32_t item = queue.get();
+		while (position < maxPriority && !present[position])
+		{
+			position++;
+		}
+		if (position == maxPriority || item != position*7+3)
+		{
+			std::cerr << "priority queue returned " << item << " NOT the item of priority " << position << "\n";
+			throw 1;
+		}
+		position++;
+		if (position < maxPriority && rand() % 8 == 0)
+		{
+			size_t later = position+rand() % std::min(maxPriority-position, (size_t)100000);
+			if (!present[later])
+			{
+				queue.insert(later*7+3, later);
+				present[later] = true;
+			}
+		}
+	}
+	while (position < maxPriority && !present[position])
+	{
+		position++;
+	}
+	if (position != maxPriority)
+	{
+		std::cerr << "priority queue empty before the item of priority " << position << "\n";
+		throw 1;
+	}
+}
+
+void testInverseInFilesWithLotsOfRandoms(int iterations, size_t size, size_t maxMemory)
+{
+	std::cerr << "Testing inverse BWT in files using " << maxMemory << " bytes with " << iterations << " random strings with length " << size << "\n";
+	std::vector<unsigned char> string(size, 0);
+	std::vector<unsigned char> transformed(size, 0);
+	std::string transformedFile = getTempFileName();
+	std::string resultFile = getTempFileName();
+	for (int iteration = 0; iteration < iterations; iteration++)
+	{
+		for (size_t i = 0; i < size-1; i++)
+		{
+			string[i] = (rand() % 4)+1; //anything except \0
+		}
+		string[size-1] = '\0';
+		bwt(string.data(), size, 255, transformed.data());
+		writeVectorToFile(transformed, transformedFile);
+		inverseBWTInFiles<unsigned char>(transformedFile, 255, maxMemory, resultFile);
+		if (readVectorFromFile<unsigned char>(resultFile, false) != string)
+		{
+			std::cerr << "inverse BWT in files of a random string NOT equal to the string\n";
+			throw 1;
+		}
+	}
+	remove(transformedFile.c_str());
+	remove(resultFile.c_str());
+}
+
 void doTests()
 {
 	testBWT();
@@ -305,6 +513,26 @@ void doTests()
 	testReversibilityWithLotsOfRandoms(10, 5000);
 	testReversibilityWithLotsOfRandoms(1, 100000);
 
+	testInverseInSegmentsWithLotsOfRandoms(200, 50, 7);
+	testInverseInSegmentsWithLotsOfRandoms(200, 50, 50);
+	testInverseInSegmentsWithLotsOfRandoms(10, 5000, 64);
+	testInverseInSegmentsWithLotsOfRandoms(1, 100000, 1000);
+	testExtractionWithLotsOfRandoms(20, 5000, 7, 0);
+	testExtractionWithLotsOfRandoms(20, 5000, 1, 100000);
+	testExtractionWithLotsOfRandoms(1, 1000000, 64, 100000);
+	testLeanBWTWithLotsOfRandoms(200, 50, 255);
+	testLeanBWTWithLotsOfRandoms(200, 50, 2);
+	testLeanBWTWithLotsOfRandoms(10, 5000, 4);
+	testLeanBWTWithLotsOfRandoms(1, 100000, 4);
+	testPriorityQueueWithLotsOfRandoms(300000, 50000, false);
+	testPriorityQueueWithLotsOfRandoms(300000, 50000, true);
+	testBWTInFilesWithLotsOfRandoms(10, 5000, 20000, defaultMaxOpenTempFiles);
+	testBWTInFilesWithLotsOfRandoms(1, 300000, 20000, defaultMaxOpenTempFiles);
+	testBWTInFilesWithLotsOfRandoms(1, 300000, 20000, 2);
+	testInverseInFilesWithLotsOfRandoms(20, 5000, 0);
+	testInverseInFilesWithLotsOfRandoms(1, 1000000, 100000);
+	testInverseInFilesWithLotsOfRandoms(1, 1000000, 100000000);
+
 }
 
 void testInFileBWT(const std::string& fileName)
@@ -347,6 +575,14 @@ void bwtFromFileInMemory(const std::string& inFile, const std::string& outFile)
 	writeVectorToFile(dst, outFile);
 }
 
+//transforms the input in place so only the suffix array is allocated on top of it
+void bwtFromFileInMemoryLean(const std::string& inFile, const std::string& outFile)
+{
+	std::vector<unsigned char> src = readVectorFromFile<unsigned char>(inFile, true);
+	bwtLean<unsigned char>(src.data(), src.size(), 255, src.data());
+	writeVectorToFile(src, outFile);
+}
+
 void inverseBwtFromFileInMemory(const std::string& inFile, const std::string& outFile)
 {
 	std::vector<unsigned char> src = readVectorFromFile<unsigned char>(inFile, false);
@@ -355,6 +591,29 @@ void inverseBwtFromFileInMemory(const std::string& inFile, const std::string& ou
 	writeVectorToFile(dst, outFile);
 }
 
+//returns false if the range or the index is invalid
+bool extractFromBWTToFile(const std::string& inFile, const std::string& indexFile, const std::string& range, const std::string& outFile)
+{
+	size_t bwtLen = getFileLengthInAlphabets<unsigned char>(inFile);
+	size_t textLen = bwtLen > 0 ? bwtLen-1 : 0;
+	size_t from;
+	size_t to;
+	char separator;
+	std::istringstream rangeStream(range);
+	if (!(rangeStream >> from >> separator >> to) || separator != ':' || from > to || to > textLen)
+	{
+		std::cerr << "range " << range << " is not from:to within the text's " << textLen << " symbols\n";
+		return false;
+	}
+	std::vector<unsigned char> extracted;
+	if (!extractFromBWT<unsigned char>(inFile, indexFile, from, to, extracted))
+	{
+		return false;
+	}
+	writeVectorToFile(extracted, outFile);
+	return true;
+}
+
 void printHelp()
 {
 	std::cerr << "Usage:\n";
@@ -362,20 +621,33 @@ void printHelp()
 	std::cerr << "Modes:\n";
 	std::cerr << "\t-t run tests\n";
 	std::cerr << "\t-m in-memory BWT\n";
+	std::cerr << "\t-l in-memory BWT with a lean memory layout, about 5 bytes of memory per input byte\n";
 	std::cerr << "\t-f in-files BWT\n";
 	std::cerr << "\t-u inverse BWT\n";
-	std::cerr << "\t-M max_bytes use max_bytes extra memory (optional, only for in-files mode)\n";
+	std::cerr << "\t-U inverse BWT which keeps only the BWT and max_bytes extra memory in memory\n";
+	std::cerr << "\t-x build an index of the BWT in in_file_name for extracting ranges of the text, written to out_file_name\n";
+	std::cerr << "\t-e from:to extract the text in [from, to) from the BWT in in_file_name using the index given with -I\n";
+	std::cerr << "\t-M max_bytes use max_bytes extra memory (optional, only for in-files modes)\n";
+	std::cerr << "\t-s rate sample the position of every rate:th suffix in the index, default 32 (optional, only for -x)\n";
+	std::cerr << "\t-I index_file_name the index built with -x (only for -e)\n";
+	std::cerr << "\t-p threads use this many threads, default is the number of hardware threads (optional)\n";
+	std::cerr << "\t-D use direct I/O for temp files, bypassing the page cache (optional, only for in-files mode)\n";
+	std::cerr << "\t-T dir create temp files in a new directory under dir instead of the current directory, can be given several times to spread the temp files over several disks (optional, only for in-files mode)\n";
+	std::cerr << "\t-F max_files keep at most max_files temp files open at once, default " << defaultMaxOpenTempFiles << " (optional, only for in-files mode)\n";
 }
 
 int main(int argc, char** argv)
 {
-	enum Mode { TEST, IN_MEMORY, IN_FILE, INVERSE, HELP };
+	enum Mode { TEST, IN_MEMORY, IN_MEMORY_LEAN, IN_FILE, INVERSE, INVERSE_IN_FILES, BUILD_INDEX, EXTRACT, HELP };
 	Mode mode = HELP;
 	int gotOption;
 	std::string inFile;
 	std::string outFile;
 	size_t maxMemory = 100000000;
-	while ((gotOption = getopt(argc, argv, "tmfhuM:i:o:")) != -1)
+	size_t sampleRate = 32;
+	std::string indexFile;
+	std::string range;
+	while ((gotOption = getopt(argc, argv, "tmlfhuUxe:s:I:DM:T:F:p:i:o:")) != -1)
 	{
 		switch(gotOption)
 		{
@@ -385,18 +657,49 @@ int main(int argc, char** argv)
 			case 'm':
 				mode = IN_MEMORY;
 				break;
+			case 'l':
+				mode = IN_MEMORY_LEAN;
+				break;
 			case 'M':
 				maxMemory = strtoul(optarg, NULL, 10);
 				break;
 			case 'f':
 				mode = IN_FILE;
 				break;
+			case 'D':
+				setIOBackend(DIRECT_IO);
+				break;
+			case 'p':
+				setNumThreads(std::max(strtoul(optarg, NULL, 10), 1ul));
+				break;
+			case 'T':
+				addTempDirectory(optarg);
+				break;
+			case 'F':
+				setMaxOpenTempFiles(std::max(strtoul(optarg, NULL, 10), 1ul));
+				break;
 			case 'h':
 				mode = HELP;
 				break;
 			case 'u':
 				mode = INVERSE;
 				break;
+			case 'U':
+				mode = INVERSE_IN_FILES;
+				break;
+			case 'x':
+				mode = BUILD_INDEX;
+				break;
+			case 'e':
+				mode = EXTRACT;
+				range = optarg;
+				break;
+			case 's':
+				sampleRate = std::max(strtoul(optarg, NULL, 10), 1ul);
+				break;
+			case 'I':
+				indexFile = optarg;
+				break;
 			case 'i':
 				inFile = optarg;
 				break;
@@ -407,7 +710,11 @@ int main(int argc, char** argv)
 				break;
 		}
 	}
-	if ((inFile == "" || outFile == "") && (mode == IN_MEMORY || mode == IN_FILE || mode == INVERSE))
+	if ((inFile == "" || outFile == "") && (mode == IN_MEMORY || mode == IN_MEMORY_LEAN || mode == IN_FILE || mode == INVERSE || mode == INVERSE_IN_FILES || mode == BUILD_INDEX || mode == EXTRACT))
+	{
+		mode = HELP;
+	}
+	if (mode == EXTRACT && indexFile == "")
 	{
 		mode = HELP;
 	}
@@ -422,6 +729,10 @@ int main(int argc, char** argv)
 			std::cerr << "Running in-memory BWT from file " << inFile << " to " << outFile << "\n";
 			bwtFromFileInMemory(inFile, outFile);
 			break;
+		case IN_MEMORY_LEAN:
+			std::cerr << "Running lean in-memory BWT from file " << inFile << " to " << outFile << "\n";
+			bwtFromFileInMemoryLean(inFile, outFile);
+			break;
 		case IN_FILE:
 			std::cerr << "Running in-file BWT from file " << inFile << " to " << outFile << " using " << maxMemory << " bytes of extra memory\n";
 			bwtInFiles(inFile, maxMemory, outFile);
@@ -430,6 +741,21 @@ int main(int argc, char** argv)
 			std::cerr << "Running inverse BWT from file " << inFile << " to " << outFile << "\n";
 			inverseBwtFromFileInMemory(inFile, outFile);
 			break;
+		case INVERSE_IN_FILES:
+			std::cerr << "Running inverse BWT in files from file " << inFile << " to " << outFile << " using " << maxMemory << " bytes of extra memory\n";
+			inverseBWTInFiles(inFile, maxMemory, outFile);
+			break;
+		case BUILD_INDEX:
+			std::cerr << "Building extraction index of BWT " << inFile << " to " << outFile << " sampling every " << sampleRate << ":th suffix\n";
+			buildExtractionIndex<unsigned char>(inFile, 255, maxMemory, sampleRate, outFile);
+			break;
+		case EXTRACT:
+			std::cerr << "Extracting " << range << " from BWT " << inFile << " with index " << indexFile << " to " << outFile << "\n";
+			if (!extractFromBWTToFile(inFile, indexFile, range, outFile))
+			{
+				return 1;
+			}
+			break;
 		case HELP:
 		default:
 			printHelp();